@@ -0,0 +1,132 @@
+#include "archive.hh"
+
+using namespace capnprof;
+using namespace kj;
+
+static const uint32_t kEndOfCentralDirectory = 0x06054b50;
+static const uint32_t kZip64EndOfCentralDirectory = 0x06064b50;
+static const uint32_t kZip64Locator = 0x07064b50;
+static const uint32_t kCentralDirectoryHeader = 0x02014b50;
+static const uint32_t kLocalFileHeader = 0x04034b50;
+static const uint16_t kZip64ExtraField = 0x0001;
+
+static uint16_t read_u16(const uint8_t *ptr) {
+  return ptr[0] | (ptr[1] << 8);
+}
+
+static uint32_t read_u32(const uint8_t *ptr) {
+  return read_u16(ptr) | (static_cast<uint32_t>(read_u16(ptr + 2)) << 16);
+}
+
+static uint64_t read_u64(const uint8_t *ptr) {
+  return read_u32(ptr) | (static_cast<uint64_t>(read_u32(ptr + 4)) << 32);
+}
+
+ArchiveIndex::ArchiveIndex(ArrayPtr<const uint8_t> data)
+    : data_(data) {
+  if (!read_central_directory()) {
+    entries_.clear();
+    by_name_.clear();
+  }
+}
+
+bool ArchiveIndex::read_central_directory() {
+  const uint32_t kEndSize = 22;
+  if (data_.size() < kEndSize)
+    return false;
+  // The end record is followed by a comment of up to 64K so scan backwards
+  // for its signature.
+  uint64_t end = data_.size() - kEndSize;
+  uint64_t scan_limit = (end > 0xFFFF) ? (end - 0xFFFF) : 0;
+  while (read_u32(data_.begin() + end) != kEndOfCentralDirectory) {
+    if (end == scan_limit)
+      return false;
+    end -= 1;
+  }
+  const uint8_t *record = data_.begin() + end;
+  uint64_t count = read_u16(record + 10);
+  uint64_t directory_size = read_u32(record + 12);
+  uint64_t directory_offset = read_u32(record + 16);
+  if (count == 0xFFFF || directory_size == 0xFFFFFFFF || directory_offset == 0xFFFFFFFF) {
+    if (end < 20 || read_u32(record - 20) != kZip64Locator)
+      return false;
+    uint64_t zip64_end = read_u64(record - 20 + 8);
+    if (zip64_end + 56 > data_.size() || read_u32(data_.begin() + zip64_end) != kZip64EndOfCentralDirectory)
+      return false;
+    const uint8_t *zip64_record = data_.begin() + zip64_end;
+    count = read_u64(zip64_record + 32);
+    directory_size = read_u64(zip64_record + 40);
+    directory_offset = read_u64(zip64_record + 48);
+  }
+  if (directory_offset + directory_size > data_.size())
+    return false;
+  const uint8_t *cursor = data_.begin() + directory_offset;
+  const uint8_t *limit = cursor + directory_size;
+  for (uint64_t i = 0; i < count; i++) {
+    if (cursor + 46 > limit || read_u32(cursor) != kCentralDirectoryHeader)
+      return false;
+    ArchiveEntry entry;
+    entry.flags = read_u16(cursor + 8);
+    entry.method = read_u16(cursor + 10);
+    entry.crc = read_u32(cursor + 16);
+    entry.compressed_size = read_u32(cursor + 20);
+    entry.size = read_u32(cursor + 24);
+    uint16_t name_size = read_u16(cursor + 28);
+    uint16_t extra_size = read_u16(cursor + 30);
+    uint16_t comment_size = read_u16(cursor + 32);
+    entry.header_offset = read_u32(cursor + 42);
+    const uint8_t *name = cursor + 46;
+    const uint8_t *extra = name + name_size;
+    const uint8_t *next = extra + extra_size + comment_size;
+    if (next > limit)
+      return false;
+    entry.name = std::string(reinterpret_cast<const char*>(name), name_size);
+    // Sizes that don't fit in 32 bits are moved to the zip64 extra field, in
+    // this order, if they overflow.
+    const uint8_t *extra_limit = extra + extra_size;
+    while (extra + 4 <= extra_limit) {
+      uint16_t id = read_u16(extra);
+      uint16_t size = read_u16(extra + 2);
+      const uint8_t *field = extra + 4;
+      const uint8_t *field_limit = field + size;
+      if (field_limit > extra_limit)
+        break;
+      if (id == kZip64ExtraField) {
+        if (entry.size == 0xFFFFFFFF && field + 8 <= field_limit) {
+          entry.size = read_u64(field);
+          field += 8;
+        }
+        if (entry.compressed_size == 0xFFFFFFFF && field + 8 <= field_limit) {
+          entry.compressed_size = read_u64(field);
+          field += 8;
+        }
+        if (entry.header_offset == 0xFFFFFFFF && field + 8 <= field_limit)
+          entry.header_offset = read_u64(field);
+      }
+      extra = field_limit;
+    }
+    by_name_[entry.name] = entries_.size();
+    entries_.push_back(entry);
+    cursor = next;
+  }
+  return true;
+}
+
+const ArchiveEntry *ArchiveIndex::find(const std::string &name) const {
+  auto iter = by_name_.find(name);
+  return (iter == by_name_.end()) ? NULL : &entries_[iter->second];
+}
+
+ArrayPtr<const uint8_t> ArchiveIndex::compressed_contents(const ArchiveEntry &entry) const {
+  const uint32_t kHeaderSize = 30;
+  if (entry.header_offset + kHeaderSize > data_.size())
+    return nullptr;
+  const uint8_t *header = data_.begin() + entry.header_offset;
+  if (read_u32(header) != kLocalFileHeader)
+    return nullptr;
+  // The local name and extra field needn't be the same as the central ones.
+  uint64_t start = entry.header_offset + kHeaderSize + read_u16(header + 26) + read_u16(header + 28);
+  if (start + entry.compressed_size > data_.size())
+    return nullptr;
+  return ArrayPtr<const uint8_t>(data_.begin() + start, entry.compressed_size);
+}
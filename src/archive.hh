@@ -0,0 +1,44 @@
+#pragma once
+
+#include <kj/common.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace capnprof {
+
+// An entry in the central directory of a zip archive.
+struct ArchiveEntry {
+  std::string name;
+  uint16_t flags;
+  uint16_t method;
+  uint32_t crc;
+  uint64_t compressed_size;
+  uint64_t size;
+  uint64_t header_offset;
+};
+
+// Reads the central directory of a zip archive, for the sizes, checksums and
+// offsets that zipprof doesn't give us. An archive that can't be read has no
+// entries.
+class ArchiveIndex {
+public:
+  ArchiveIndex(kj::ArrayPtr<const uint8_t> data);
+  const std::vector<ArchiveEntry> &entries() const { return entries_; }
+  const ArchiveEntry *find(const std::string &name) const;
+
+  // Returns the entry's data as stored in the archive, or an empty array if
+  // its local header is missing or the data runs past the end.
+  kj::ArrayPtr<const uint8_t> compressed_contents(const ArchiveEntry &entry) const;
+
+private:
+  bool read_central_directory();
+
+  kj::ArrayPtr<const uint8_t> data_;
+  std::vector<ArchiveEntry> entries_;
+  std::unordered_map<std::string, uint32_t> by_name_;
+};
+
+} // namespace capnprof
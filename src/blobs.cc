@@ -0,0 +1,145 @@
+#include "blobs.hh"
+
+#include "stats.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace capnprof;
+using namespace kj;
+
+BlobSketch::BlobSketch()
+    : count_(0)
+    , bytes_(0) {
+  memset(registers_, 0, sizeof(registers_));
+}
+
+// MurmurHash64A.
+uint64_t BlobSketch::hash(ArrayPtr<const byte> data) {
+  const uint64_t kMul = 0xc6a4a7935bd1e995ULL;
+  const uint32_t kShift = 47;
+  uint64_t result = 0x8445d61a4e774912ULL ^ (data.size() * kMul);
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    uint64_t block;
+    memcpy(&block, data.begin() + i, 8);
+    block *= kMul;
+    block ^= block >> kShift;
+    block *= kMul;
+    result ^= block;
+    result *= kMul;
+  }
+  if (i < data.size()) {
+    uint64_t tail = 0;
+    memcpy(&tail, data.begin() + i, data.size() - i);
+    result ^= tail;
+    result *= kMul;
+  }
+  result ^= result >> kShift;
+  result *= kMul;
+  result ^= result >> kShift;
+  return result;
+}
+
+void BlobSketch::add(ArrayPtr<const byte> data) {
+  uint64_t blob_hash = hash(data);
+  uint32_t size = word_align(data.size());
+  count_ += 1;
+  bytes_ += size;
+  add_hash(blob_hash);
+  add_top(blob_hash, 1, 0, size, data.slice(0, std::min<size_t>(data.size(), kSampleSize)));
+}
+
+void BlobSketch::add_hash(uint64_t blob_hash) {
+  uint32_t index = blob_hash >> (64 - kRegisterBits);
+  uint64_t rest = blob_hash << kRegisterBits;
+  uint8_t rank = 1;
+  while (rank <= (64 - kRegisterBits) && (rest & (1ULL << 63)) == 0) {
+    rest <<= 1;
+    rank += 1;
+  }
+  registers_[index] = std::max(registers_[index], rank);
+}
+
+void BlobSketch::add_top(uint64_t blob_hash, uint64_t count, uint64_t error,
+    uint32_t size, ArrayPtr<const byte> sample) {
+  for (Blob &blob : top_) {
+    if (blob.hash == blob_hash) {
+      blob.count += count;
+      blob.error += error;
+      return;
+    }
+  }
+  if (top_.size() < kTopCount) {
+    top_.push_back({blob_hash, count, error, size,
+        std::string(reinterpret_cast<const char*>(sample.begin()), sample.size())});
+    return;
+  }
+  // Replace the least frequent blob, which the new one may have been hiding
+  // behind all along.
+  Blob *min = &top_[0];
+  for (Blob &blob : top_) {
+    if (blob.count < min->count)
+      min = &blob;
+  }
+  *min = {blob_hash, min->count + count, min->count + error, size,
+      std::string(reinterpret_cast<const char*>(sample.begin()), sample.size())};
+}
+
+void BlobSketch::merge(const BlobSketch &that) {
+  count_ += that.count_;
+  bytes_ += that.bytes_;
+  for (uint32_t i = 0; i < kRegisterCount; i++)
+    registers_[i] = std::max(registers_[i], that.registers_[i]);
+  for (const Blob &blob : that.top_) {
+    ArrayPtr<const byte> sample(reinterpret_cast<const byte*>(blob.sample.data()),
+        blob.sample.size());
+    add_top(blob.hash, blob.count, blob.error, blob.size, sample);
+  }
+}
+
+double BlobSketch::distinct() const {
+  const double kCount = kRegisterCount;
+  double sum = 0;
+  uint32_t zeros = 0;
+  for (uint32_t i = 0; i < kRegisterCount; i++) {
+    sum += ldexp(1.0, -registers_[i]);
+    if (registers_[i] == 0)
+      zeros += 1;
+  }
+  double alpha = 0.7213 / (1 + 1.079 / kCount);
+  double estimate = alpha * kCount * kCount / sum;
+  // Linear counting is more accurate while many registers are still empty.
+  if (estimate <= 2.5 * kCount && zeros > 0)
+    estimate = kCount * log(kCount / zeros);
+  return std::min(estimate, static_cast<double>(count_));
+}
+
+double BlobSketch::interning_savings() const {
+  // The top blobs are known well enough to count exactly what interning them
+  // saves. For the rest assume they're all the same size.
+  double saved = 0;
+  double rest_count = count_;
+  double rest_bytes = bytes_;
+  for (const Blob &blob : top_) {
+    uint64_t guaranteed = blob.count - blob.error;
+    saved += (guaranteed - 1) * static_cast<double>(blob.size);
+    rest_count -= guaranteed;
+    rest_bytes -= guaranteed * static_cast<double>(blob.size);
+  }
+  double rest_distinct = std::max(0.0, distinct() - top_.size());
+  if (rest_count > 0 && rest_bytes > 0) {
+    double rest_mean_size = rest_bytes / rest_count;
+    saved += std::max(0.0, rest_bytes - rest_distinct * rest_mean_size);
+  }
+  return saved;
+}
+
+std::vector<BlobSketch::Blob> BlobSketch::top() const {
+  std::vector<Blob> result = top_;
+  std::sort(result.begin(), result.end(), [](const Blob &a, const Blob &b) {
+    return a.count > b.count;
+  });
+  return result;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <kj/common.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace capnprof {
+
+// A bounded-memory summary of the Text and Data blobs seen under a trace. The
+// number of distinct blobs is estimated with a HyperLogLog and the most
+// frequent blobs are tracked with the space-saving algorithm, so the size
+// stays the same however many blobs are added.
+class BlobSketch {
+public:
+  static const uint32_t kRegisterBits = 8;
+  static const uint32_t kRegisterCount = 1 << kRegisterBits;
+  static const uint32_t kTopCount = 16;
+  static const uint32_t kSampleSize = 32;
+
+  struct Blob {
+    uint64_t hash;
+    // The count is an overestimate by at most error.
+    uint64_t count;
+    uint64_t error;
+    uint32_t size;
+    std::string sample;
+  };
+
+  BlobSketch();
+  void add(kj::ArrayPtr<const kj::byte> data);
+  void merge(const BlobSketch &that);
+
+  uint64_t count() const { return count_; }
+  uint64_t bytes() const { return bytes_; }
+  double distinct() const;
+
+  // Estimated bytes saved by storing each distinct blob once, not counting the
+  // cost of referring to them.
+  double interning_savings() const;
+
+  // The most frequent blobs, most frequent first.
+  std::vector<Blob> top() const;
+
+  static uint64_t hash(kj::ArrayPtr<const kj::byte> data);
+
+private:
+  void add_hash(uint64_t hash);
+  void add_top(uint64_t hash, uint64_t count, uint64_t error, uint32_t size,
+      kj::ArrayPtr<const kj::byte> sample);
+
+  uint8_t registers_[kRegisterCount];
+  uint64_t count_;
+  uint64_t bytes_;
+  std::vector<Blob> top_;
+};
+
+} // namespace capnprof
@@ -0,0 +1,183 @@
+#include "budget.hh"
+
+#include <fnmatch.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+using namespace capnprof;
+
+static bool parse_metric(const std::string &str, BudgetRule::Metric *out) {
+  if (str == "bytes") {
+    *out = BudgetRule::Metric::BYTES;
+  } else if (str == "weight") {
+    *out = BudgetRule::Metric::WEIGHT;
+  } else if (str == "factor") {
+    *out = BudgetRule::Metric::FACTOR;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool parse_limit(const std::string &str, BudgetRule *out) {
+  if (str.empty())
+    return false;
+  out->is_relative = (str[0] == '+');
+  const char *start = str.c_str() + (out->is_relative ? 1 : 0);
+  char *end;
+  out->limit = strtod(start, &end);
+  if (end == start || out->limit < 0)
+    return false;
+  std::string suffix = end;
+  if (out->is_relative) {
+    out->limit /= 100;
+    return suffix == "%";
+  }
+  if (suffix == "K") {
+    out->limit *= 1024;
+  } else if (suffix == "M") {
+    out->limit *= 1024 * 1024;
+  } else if (suffix == "G") {
+    out->limit *= 1024 * 1024 * 1024;
+  } else if (!suffix.empty()) {
+    return false;
+  }
+  return true;
+}
+
+bool Budget::parse(std::istream &in, std::string *error) {
+  std::string line;
+  uint32_t line_number = 0;
+  while (std::getline(in, line)) {
+    line_number += 1;
+    size_t start = line.find_first_not_of(" \t");
+    if (start == std::string::npos || line[start] == '#')
+      continue;
+    // The pattern may contain spaces, so the metric and limit are taken from
+    // the end.
+    std::stringstream words(line);
+    std::vector<std::string> parts;
+    std::string word;
+    while (words >> word)
+      parts.push_back(word);
+    BudgetRule rule;
+    rule.line = line_number;
+    if (parts.size() < 3 || !parse_metric(parts[parts.size() - 2], &rule.metric)
+        || !parse_limit(parts.back(), &rule)) {
+      *error = "Invalid budget on line " + std::to_string(line_number) + ": " + line;
+      return false;
+    }
+    for (uint32_t i = 0; i < parts.size() - 2; i++)
+      rule.pattern += (i > 0 ? " " : "") + parts[i];
+    // List elements are written [], which fnmatch would take for a set.
+    for (size_t pos = rule.pattern.find("[]"); pos != std::string::npos;
+        pos = rule.pattern.find("[]", pos + 4))
+      rule.pattern.replace(pos, 2, "\\[\\]");
+    rules_.push_back(rule);
+  }
+  return true;
+}
+
+bool Budget::has_relative_rules() const {
+  for (const BudgetRule &rule : rules_) {
+    if (rule.is_relative)
+      return true;
+  }
+  return false;
+}
+
+bool Budget::load(std::string path, std::string *error) {
+  std::ifstream file(path);
+  if (!file) {
+    *error = "Couldn't open file " + path;
+    return false;
+  }
+  return parse(file, error);
+}
+
+const char *Budget::metric_name(BudgetRule::Metric metric) {
+  switch (metric) {
+  case BudgetRule::Metric::BYTES:
+    return "bytes";
+  case BudgetRule::Metric::WEIGHT:
+    return "weight";
+  case BudgetRule::Metric::FACTOR:
+    return "factor";
+  default:
+    return "?";
+  }
+}
+
+double Budget::value(const Trace &trace, BudgetRule::Metric metric) {
+  switch (metric) {
+  case BudgetRule::Metric::BYTES:
+    return trace.stats().accum_bytes();
+  case BudgetRule::Metric::WEIGHT:
+    return trace.stats().accum_weight();
+  case BudgetRule::Metric::FACTOR:
+    return trace.stats().accum_factor();
+  default:
+    return 0;
+  }
+}
+
+static std::string path_string(const Trace &trace) {
+  std::stringstream buf;
+  buf << trace;
+  return buf.str();
+}
+
+std::vector<BudgetViolation> Budget::check(Profiler &profiler, Profiler *baseline) {
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SERIAL, false, &traces);
+  std::vector<std::string> paths;
+  for (const Trace *trace : traces)
+    paths.push_back(path_string(*trace));
+  // The two profiles have their own schemas so traces are matched by path.
+  std::unordered_map<std::string, const Trace*> baseline_traces;
+  if (baseline != NULL) {
+    std::vector<Trace*> traces;
+    baseline->traces(Trace::Order::SERIAL, false, &traces);
+    for (const Trace *trace : traces)
+      baseline_traces[path_string(*trace)] = trace;
+  }
+
+  std::vector<BudgetViolation> violations;
+  for (const BudgetRule &rule : rules_) {
+    for (uint32_t i = 0; i < traces.size(); i++) {
+      if (fnmatch(rule.pattern.c_str(), paths[i].c_str(), 0) != 0)
+        continue;
+      BudgetViolation violation;
+      violation.rule = &rule;
+      violation.path = paths[i];
+      violation.value = value(*traces[i], rule.metric);
+      violation.baseline = 0;
+      if (rule.is_relative) {
+        auto base = baseline_traces.find(paths[i]);
+        if (base == baseline_traces.end())
+          continue;
+        violation.baseline = value(*base->second, rule.metric);
+        violation.limit = violation.baseline * (1 + rule.limit);
+      } else {
+        violation.limit = rule.limit;
+      }
+      if (violation.value > violation.limit)
+        violations.push_back(violation);
+    }
+  }
+  return violations;
+}
+
+void Budget::print(const std::vector<BudgetViolation> &violations, FILE *out) {
+  for (const BudgetViolation &violation : violations) {
+    const BudgetRule &rule = *violation.rule;
+    fprintf(out, "over budget: %s %s %.3f > %.3f", violation.path.c_str(),
+        metric_name(rule.metric), violation.value, violation.limit);
+    if (rule.is_relative)
+      fprintf(out, " (baseline %.3f +%.1f%%)", violation.baseline, rule.limit * 100);
+    fprintf(out, " [budget line %u]\n", rule.line);
+  }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "prof.hh"
+
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace capnprof {
+
+// A limit on a metric of the traces whose paths match a glob pattern. Paths
+// are written as in the profile, from the root down, like "Root.a []", and
+// [] in a pattern matches list elements rather than starting a set.
+struct BudgetRule {
+  enum class Metric {
+    BYTES,   // Accumulated bytes.
+    WEIGHT,  // Accumulated weight.
+    FACTOR   // Accumulated weight per byte.
+  };
+
+  std::string pattern;
+  Metric metric;
+  // Either the limit itself or, if relative, the fraction the metric may grow
+  // by over the baseline.
+  double limit;
+  bool is_relative;
+  uint32_t line;
+};
+
+// A trace that exceeded its budget.
+struct BudgetViolation {
+  const BudgetRule *rule;
+  std::string path;
+  double value;
+  double limit;
+  double baseline;
+};
+
+// A set of size budgets to check a profile against, so growth can fail a
+// build. Budget files have one rule per line,
+//
+//   PATTERN METRIC LIMIT
+//
+// where the metric is bytes, weight or factor and the limit is a number,
+// optionally with a K, M or G suffix, or +N% to allow growth of up to N
+// percent over a baseline profile. Lines starting with # are comments.
+class Budget {
+public:
+  // Returns false and describes the first error if the rules are malformed.
+  bool parse(std::istream &in, std::string *error);
+  bool load(std::string path, std::string *error);
+  const std::vector<BudgetRule> &rules() const { return rules_; }
+  bool has_relative_rules() const;
+
+  // Checks every trace that matches a rule against it. Relative rules are
+  // checked against the trace with the same path in the baseline and skip
+  // traces that aren't in it, whose growth still counts against their
+  // parents.
+  std::vector<BudgetViolation> check(Profiler &profiler, Profiler *baseline);
+
+  static void print(const std::vector<BudgetViolation> &violations, FILE *out = stderr);
+  static const char *metric_name(BudgetRule::Metric metric);
+
+private:
+  static double value(const Trace &trace, BudgetRule::Metric metric);
+
+  std::vector<BudgetRule> rules_;
+};
+
+} // namespace capnprof
@@ -0,0 +1,104 @@
+#include "cache.hh"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+using namespace capnprof;
+
+// Bump the version when the file layout or the way weights are computed
+// changes, so stale profiles are ignored rather than misread.
+static const char kMagic[8] = {'C', 'P', 'R', 'O', 'F', 'D', 'P', 'C'};
+static const uint32_t kVersion = 1;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+ProfileCache::ProfileCache(std::string dir)
+    : dir_(dir)
+    , hits_(0)
+    , misses_(0)
+    , next_temp_(0) {
+  mkdir(dir_.c_str(), 0755);
+}
+
+std::string ProfileCache::path_for(const ArchiveEntry &entry, HeatPolicy policy) {
+  const char *extension;
+  switch (policy) {
+  case HeatPolicy::MATCH:
+    extension = "mp";
+    break;
+  case HeatPolicy::MATCH_SOURCE:
+    extension = "sp";
+    break;
+  default:
+    extension = "dp";
+    break;
+  }
+  char name[96];
+  snprintf(name, sizeof(name), "%08x-%016" PRIx64 "-%016" PRIx64 "-%04x-%04x.%s",
+      entry.crc, entry.size, entry.compressed_size, entry.method, entry.flags, extension);
+  return dir_ + "/" + name;
+}
+
+bool ProfileCache::load(const ArchiveEntry &entry, HeatPolicy policy, CachedProfile *out) {
+  std::ifstream file(path_for(entry, policy), std::ios::binary);
+  CacheHeader header;
+  if (!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header))
+      || memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion
+      || header.size != entry.size) {
+    misses_ += 1;
+    return false;
+  }
+  uint64_t word_count = (header.size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+  out->contents = kj::heapArray<capnp::word>(word_count);
+  memset(out->contents.begin(), 0, word_count * sizeof(capnp::word));
+  out->size = header.size;
+  out->weights.resize(header.size);
+  if (!file.read(reinterpret_cast<char*>(out->contents.begin()), word_count * sizeof(capnp::word))
+      || !file.read(reinterpret_cast<char*>(out->weights.data()), header.size * sizeof(double))) {
+    misses_ += 1;
+    return false;
+  }
+  hits_ += 1;
+  return true;
+}
+
+void ProfileCache::store(const ArchiveEntry &entry, HeatPolicy policy,
+    kj::ArrayPtr<const uint8_t> contents, const std::vector<double> &weights) {
+  CacheHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.reserved = 0;
+  header.size = contents.size();
+  // Write to the side and then move into place so a run that dies halfway
+  // doesn't leave a truncated profile behind. Identical entries in different
+  // archives share a path, and other runs can share the directory, so each
+  // write gets a temp file of its own.
+  std::string path = path_for(entry, policy);
+  std::string temp_path = path + ".tmp" + std::to_string(getpid()) + "."
+      + std::to_string(next_temp_++);
+  bool ok;
+  {
+    std::ofstream file(temp_path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(contents.begin()), contents.size());
+    static const char kPadding[sizeof(capnp::word)] = {0};
+    uint32_t padding = (sizeof(capnp::word) - (contents.size() % sizeof(capnp::word)))
+        % sizeof(capnp::word);
+    file.write(kPadding, padding);
+    file.write(reinterpret_cast<const char*>(weights.data()), weights.size() * sizeof(double));
+    file.close();
+    ok = static_cast<bool>(file);
+  }
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+    remove(temp_path.c_str());
+}
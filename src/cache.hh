@@ -0,0 +1,51 @@
+#pragma once
+
+#include "archive.hh"
+#include "heatmap.hh"
+
+#include <capnp/common.h>
+#include <kj/array.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace capnprof {
+
+// The contents of an archive entry and the weight of each of its bytes, as
+// computed by zipprof or, for the match-aware heat policies, the Inflater.
+struct CachedProfile {
+  kj::Array<capnp::word> contents;
+  uint64_t size;
+  std::vector<double> weights;
+};
+
+// A directory of deflate profiles so archives that are profiled again don't
+// have to be inflated and profiled by zipprof again. Entries are keyed by
+// their checksum, sizes, compression method and flags, so an entry that is
+// replaced by one with different contents gets a new key, and by the heat
+// policy the weights were computed with. Entries can be loaded and stored
+// from several threads at once.
+class ProfileCache {
+public:
+  explicit ProfileCache(std::string dir);
+
+  // Returns false if there is no usable profile for the entry.
+  bool load(const ArchiveEntry &entry, HeatPolicy policy, CachedProfile *out);
+  void store(const ArchiveEntry &entry, HeatPolicy policy, kj::ArrayPtr<const uint8_t> contents,
+      const std::vector<double> &weights);
+
+  uint32_t hits() const { return hits_; }
+  uint32_t misses() const { return misses_; }
+
+private:
+  std::string path_for(const ArchiveEntry &entry, HeatPolicy policy);
+
+  std::string dir_;
+  std::atomic<uint32_t> hits_;
+  std::atomic<uint32_t> misses_;
+  std::atomic<uint32_t> next_temp_;
+};
+
+} // namespace capnprof
@@ -0,0 +1,227 @@
+// A capnp compiler plugin that generates a profiler for each struct in a
+// schema, so messages can be profiled without going through the dynamic API:
+//
+//   capnp compile -o path/to/capnpc-cprof:outdir foo.capnp
+//
+// writes outdir/foo.capnp.cprof.h. Register its profilers with
+// cprof_foo_capnp::add_profilers(profiler) before profiling.
+//
+// Structs with unions or groups, and fields whose values the dynamic
+// traversal has to interpret (AnyPointer, nested lists), are left to the
+// dynamic API.
+
+#include <capnp/schema.capnp.h>
+#include <capnp/schema-loader.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace capnp;
+
+static std::string sanitize(std::string name) {
+  for (char &c : name) {
+    if (!isalnum(static_cast<unsigned char>(c)))
+      c = '_';
+  }
+  return name;
+}
+
+static std::string hex_id(uint64_t id) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%016llxULL", static_cast<unsigned long long>(id));
+  return buf;
+}
+
+static std::string function_name(StructSchema schema) {
+  schema::Node::Reader node = schema.getProto();
+  std::string display_name = node.getDisplayName().cStr();
+  return "profile_" + sanitize(display_name.substr(node.getDisplayNamePrefixLength()));
+}
+
+static bool is_primitive(schema::Type::Which which) {
+  switch (which) {
+    case schema::Type::Which::BOOL:
+    case schema::Type::Which::INT8:
+    case schema::Type::Which::INT16:
+    case schema::Type::Which::INT32:
+    case schema::Type::Which::INT64:
+    case schema::Type::Which::UINT8:
+    case schema::Type::Which::UINT16:
+    case schema::Type::Which::UINT32:
+    case schema::Type::Which::UINT64:
+    case schema::Type::Which::FLOAT32:
+    case schema::Type::Which::FLOAT64:
+    case schema::Type::Which::ENUM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+class Generator {
+public:
+  explicit Generator(SchemaLoader &loader)
+      : loader_(loader) { }
+
+  bool generate(schema::CodeGeneratorRequest::RequestedFile::Reader file);
+
+private:
+  void collect(Schema schema);
+  bool is_supported(StructSchema schema);
+  void write_struct(std::ostream &out, StructSchema schema);
+  void write_field(std::ostream &out, StructSchema::Field field, uint32_t index);
+  std::string struct_call(StructSchema schema, const char *path, const char *reader);
+
+  SchemaLoader &loader_;
+  std::vector<StructSchema> structs_;
+  std::unordered_set<uint64_t> generated_;
+};
+
+void Generator::collect(Schema schema) {
+  schema::Node::Reader node = schema.getProto();
+  if (node.isStruct() && is_supported(schema.asStruct())) {
+    structs_.push_back(schema.asStruct());
+    generated_.insert(node.getId());
+  }
+  for (auto nested : node.getNestedNodes())
+    collect(loader_.get(nested.getId()));
+}
+
+bool Generator::is_supported(StructSchema schema) {
+  schema::Node::Reader node = schema.getProto();
+  if (node.getIsGeneric() || node.getStruct().getDiscriminantCount() > 0)
+    return false;
+  for (auto field : schema.getFields()) {
+    if (field.getProto().isGroup())
+      return false;
+  }
+  return true;
+}
+
+std::string Generator::struct_call(StructSchema schema, const char *path, const char *reader) {
+  if (generated_.count(schema.getProto().getId()) > 0)
+    return function_name(schema) + "(ctx, " + path + ", " + reader + ");";
+  return std::string("ctx.profile_struct(") + path + ", " + reader + ", "
+      + hex_id(schema.getProto().getId()) + ");";
+}
+
+void Generator::write_field(std::ostream &out, StructSchema::Field field, uint32_t index) {
+  capnp::Type type = field.getType();
+  if (type.isVoid())
+    return;
+  if (is_primitive(type.which())) {
+    out << "  ctx.read_primitive(path);\n";
+    return;
+  }
+  uint32_t slot = field.getProto().getSlot().getOffset();
+  bool is_list = type.isList() || type.isText() || type.isData();
+  std::string pointer = "pointers[" + std::to_string(slot) + "]";
+  out << "  if (pointers.size() > " << slot << " && !" << pointer << ".isNull()) {\n";
+  out << "    capnprof::TracePath inner(path, schema.getFields()[" << index << "]);\n";
+  out << "    ctx.follow_pointer(inner, reader, " << slot << ", "
+      << (is_list ? "true" : "false") << ");\n";
+  capnp::Type element = type.isList() ? type.asList().getElementType() : type;
+  if (type.isText()) {
+    out << "    ctx.profile_text(inner, " << pointer << ".getAs<capnp::Text>());\n";
+  } else if (type.isData()) {
+    out << "    ctx.profile_data(inner, " << pointer << ".getAs<capnp::Data>());\n";
+  } else if (type.isStruct()) {
+    std::string reader = pointer + ".getAs<capnp::AnyStruct>()";
+    out << "    " << struct_call(type.asStruct(), "inner", reader.c_str()) << "\n";
+  } else if (type.isList() && is_primitive(element.which())) {
+    out << "    ctx.profile_primitive_list(inner, " << pointer << ".getAs<capnp::AnyList>());\n";
+  } else if (type.isList() && element.isText()) {
+    out << "    ctx.profile_text_list(inner, " << pointer
+        << ".getAs<capnp::List<capnp::Text>>());\n";
+  } else if (type.isList() && element.isData()) {
+    out << "    ctx.profile_data_list(inner, " << pointer
+        << ".getAs<capnp::List<capnp::Data>>());\n";
+  } else if (type.isList() && element.isStruct()) {
+    out << "    auto any_list = " << pointer << ".getAs<capnp::AnyList>();\n";
+    out << "    auto list = any_list.as<capnp::List<capnp::AnyStruct>>();\n";
+    out << "    if (list.size() > 0) {\n";
+    out << "      ctx.read_elements(inner, list.size());\n";
+    out << "      ctx.add_list_overhead(inner, any_list);\n";
+    out << "      capnprof::TracePath elements(inner, capnprof::TraceLink::Type::ARRAY);\n";
+    out << "      for (auto element : list)\n";
+    out << "        " << struct_call(element.asStruct(), "elements", "element") << "\n";
+    out << "    }\n";
+  } else {
+    out << "    ctx.profile_field(inner, reader, schema, " << index << ");\n";
+  }
+  out << "  }\n";
+}
+
+void Generator::write_struct(std::ostream &out, StructSchema schema) {
+  out << "inline void " << function_name(schema)
+      << "(capnprof::StaticContext &ctx, capnprof::TracePath &path,\n"
+      << "    capnp::AnyStruct::Reader reader) {\n";
+  out << "  capnp::StructSchema schema = ctx.schema(" << hex_id(schema.getProto().getId())
+      << ");\n";
+  out << "  ctx.add_sections(path, reader, schema);\n";
+  out << "  auto pointers = reader.getPointerSection();\n";
+  out << "  (void) schema;\n";
+  out << "  (void) pointers;\n";
+  uint32_t index = 0;
+  for (auto field : schema.getFields())
+    write_field(out, field, index++);
+  out << "}\n\n";
+}
+
+bool Generator::generate(schema::CodeGeneratorRequest::RequestedFile::Reader file) {
+  structs_.clear();
+  generated_.clear();
+  collect(loader_.get(file.getId()));
+
+  std::string filename = std::string(file.getFilename().cStr()) + ".cprof.h";
+  std::ofstream out(filename);
+  if (!out) {
+    std::cerr << "Couldn't write " << filename << std::endl;
+    return false;
+  }
+  out << "// Generated by capnpc-cprof from " << file.getFilename().cStr()
+      << ". Do not edit.\n\n";
+  out << "#pragma once\n\n";
+  out << "#include \"static.hh\"\n\n";
+  out << "#include <capnp/any.h>\n\n";
+  out << "namespace cprof_" << sanitize(file.getFilename().cStr()) << " {\n\n";
+  for (StructSchema schema : structs_) {
+    out << "inline void " << function_name(schema)
+        << "(capnprof::StaticContext &ctx, capnprof::TracePath &path,\n"
+        << "    capnp::AnyStruct::Reader reader);\n";
+  }
+  out << "\n";
+  for (StructSchema schema : structs_)
+    write_struct(out, schema);
+  out << "inline void add_profilers(capnprof::Profiler &profiler) {\n";
+  for (StructSchema schema : structs_) {
+    out << "  profiler.add_static_profiler(" << hex_id(schema.getProto().getId()) << ", &"
+        << function_name(schema) << ");\n";
+  }
+  out << "}\n\n";
+  out << "} // namespace cprof_" << sanitize(file.getFilename().cStr()) << "\n";
+  return static_cast<bool>(out);
+}
+
+int main(int argc, char *argv[]) {
+  StreamFdMessageReader message(STDIN_FILENO);
+  schema::CodeGeneratorRequest::Reader request = message.getRoot<schema::CodeGeneratorRequest>();
+  SchemaLoader loader;
+  for (auto node : request.getNodes())
+    loader.load(node);
+  Generator generator(loader);
+  for (auto file : request.getRequestedFiles()) {
+    if (!generator.generate(file))
+      return 1;
+  }
+  return 0;
+}
@@ -4,8 +4,23 @@
 
 #include <kj/common.h>
 
+#include <utility>
+#include <vector>
+
 namespace capnprof {
 
+// How the compressed size of an archive entry is charged to its bytes.
+enum class HeatPolicy {
+  // The literal contributions computed by zipprof, where bytes produced by
+  // matches come almost for free.
+  LITERAL,
+  // Each match's cost is spread evenly over the bytes it produces.
+  MATCH,
+  // Like MATCH but half of each match's cost goes to the bytes it copies,
+  // which are what made the match possible.
+  MATCH_SOURCE
+};
+
 class HeatMap {
 public:
   virtual ~HeatMap() { }
@@ -21,4 +36,14 @@ private:
   zipprof::DeflateProfile &profile_;
 };
 
+// A heat map over weights computed earlier, one per byte.
+class ArrayHeatMap : public HeatMap {
+public:
+  explicit ArrayHeatMap(std::vector<double> weights)
+      : weights_(std::move(weights)) { }
+  virtual double weight(uint32_t first_byte, uint32_t limit_byte);
+private:
+  std::vector<double> weights_;
+};
+
 } // namespace capnprof
@@ -0,0 +1,313 @@
+#include "inflate.hh"
+
+#include <cstring>
+
+using namespace capnprof;
+using namespace kj;
+
+// The tables of RFC 1951, section 3.2.5.
+static const uint16_t kLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint16_t kLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t kDistanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint16_t kDistanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t kCodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+Inflater::Inflater(HeatPolicy policy)
+    : policy_(policy)
+    , pos_(0)
+    , bit_buffer_(0)
+    , bit_count_(0)
+    , overhead_bits_(0)
+    , literal_count_(0)
+    , match_count_(0) { }
+
+bool Inflater::bits(uint32_t need, uint32_t *out) {
+  uint64_t value = bit_buffer_;
+  while (bit_count_ < need) {
+    if (pos_ >= in_.size())
+      return false;
+    value |= static_cast<uint64_t>(in_[pos_++]) << bit_count_;
+    bit_count_ += 8;
+  }
+  *out = static_cast<uint32_t>(value & ((1ull << need) - 1));
+  bit_buffer_ = static_cast<uint32_t>(value >> need);
+  bit_count_ -= need;
+  return true;
+}
+
+// Returns 0 for a complete code, a positive number for an incomplete one and
+// a negative number if there are more codes of some length than fit.
+int32_t Inflater::build(Huffman *huffman, const uint16_t *lengths, uint32_t count) {
+  memset(huffman->count, 0, sizeof(huffman->count));
+  for (uint32_t symbol = 0; symbol < count; symbol++)
+    huffman->count[lengths[symbol]] += 1;
+  if (huffman->count[0] == count)
+    return 0;
+  int32_t left = 1;
+  for (uint32_t length = 1; length <= kMaxBits; length++) {
+    left <<= 1;
+    left -= huffman->count[length];
+    if (left < 0)
+      return left;
+  }
+  uint16_t offsets[kMaxBits + 1];
+  offsets[1] = 0;
+  for (uint32_t length = 1; length < kMaxBits; length++)
+    offsets[length + 1] = offsets[length] + huffman->count[length];
+  for (uint32_t symbol = 0; symbol < count; symbol++) {
+    if (lengths[symbol] != 0)
+      huffman->symbol[offsets[lengths[symbol]]++] = symbol;
+  }
+  return left;
+}
+
+int32_t Inflater::decode(const Huffman &huffman) {
+  int32_t code = 0;
+  int32_t first = 0;
+  int32_t index = 0;
+  for (uint32_t length = 1; length <= kMaxBits; length++) {
+    uint32_t bit;
+    if (!bits(1, &bit))
+      return -1;
+    code |= bit;
+    int32_t count = huffman.count[length];
+    if (code - count < first)
+      return huffman.symbol[index + (code - first)];
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+void Inflater::charge_match(uint64_t dest, uint32_t length, uint32_t distance, double bits) {
+  if (policy_ == HeatPolicy::MATCH_SOURCE) {
+    double share = bits / (2.0 * length);
+    for (uint32_t i = 0; i < length; i++) {
+      weights_[dest + i] += share;
+      weights_[dest - distance + i] += share;
+    }
+  } else {
+    double share = bits / length;
+    for (uint32_t i = 0; i < length; i++)
+      weights_[dest + i] += share;
+  }
+}
+
+void Inflater::spread_overhead(uint64_t block_start) {
+  uint64_t count = contents_.size() - block_start;
+  if (count == 0)
+    return;
+  double share = overhead_bits_ / count;
+  for (uint64_t i = block_start; i < contents_.size(); i++)
+    weights_[i] += share;
+  overhead_bits_ = 0;
+}
+
+bool Inflater::codes(const Huffman &lengths, const Huffman &distances) {
+  while (true) {
+    uint64_t start = position();
+    int32_t symbol = decode(lengths);
+    if (symbol < 0)
+      return false;
+    if (symbol < 256) {
+      contents_.push_back(static_cast<uint8_t>(symbol));
+      weights_.push_back(position() - start);
+      literal_count_ += 1;
+      continue;
+    }
+    if (symbol == 256) {
+      overhead_bits_ += position() - start;
+      return true;
+    }
+    symbol -= 257;
+    if (symbol >= 29)
+      return false;
+    uint32_t extra;
+    if (!bits(kLengthExtra[symbol], &extra))
+      return false;
+    uint32_t length = kLengthBase[symbol] + extra;
+    int32_t distance_symbol = decode(distances);
+    if (distance_symbol < 0 || distance_symbol >= 30)
+      return false;
+    if (!bits(kDistanceExtra[distance_symbol], &extra))
+      return false;
+    uint32_t distance = kDistanceBase[distance_symbol] + extra;
+    if (distance > contents_.size())
+      return false;
+    uint64_t dest = contents_.size();
+    // Matches can overlap what they produce so copy a byte at a time.
+    for (uint32_t i = 0; i < length; i++)
+      contents_.push_back(contents_[dest - distance + i]);
+    weights_.resize(contents_.size(), 0);
+    charge_match(dest, length, distance, position() - start);
+    match_count_ += 1;
+  }
+}
+
+bool Inflater::stored_block() {
+  // The length follows at the next byte boundary.
+  overhead_bits_ += bit_count_;
+  bit_buffer_ = 0;
+  bit_count_ = 0;
+  if (pos_ + 4 > in_.size())
+    return false;
+  uint32_t length = in_[pos_] | (in_[pos_ + 1] << 8);
+  uint32_t check = in_[pos_ + 2] | (in_[pos_ + 3] << 8);
+  if (length != (~check & 0xFFFF) || pos_ + 4 + length > in_.size())
+    return false;
+  overhead_bits_ += 32;
+  pos_ += 4;
+  contents_.insert(contents_.end(), in_.begin() + pos_, in_.begin() + pos_ + length);
+  weights_.resize(contents_.size(), 8);
+  pos_ += length;
+  return true;
+}
+
+Inflater::FixedCodes::FixedCodes() {
+  uint16_t code_lengths[kMaxSymbols];
+  uint32_t symbol = 0;
+  for (; symbol < 144; symbol++)
+    code_lengths[symbol] = 8;
+  for (; symbol < 256; symbol++)
+    code_lengths[symbol] = 9;
+  for (; symbol < 280; symbol++)
+    code_lengths[symbol] = 7;
+  for (; symbol < kMaxSymbols; symbol++)
+    code_lengths[symbol] = 8;
+  build(&lengths, code_lengths, kMaxSymbols);
+  for (symbol = 0; symbol < 30; symbol++)
+    code_lengths[symbol] = 5;
+  build(&distances, code_lengths, 30);
+}
+
+bool Inflater::fixed_block() {
+  static const FixedCodes kFixedCodes;
+  return codes(kFixedCodes.lengths, kFixedCodes.distances);
+}
+
+bool Inflater::dynamic_block() {
+  // The code tables are part of the block's overhead.
+  uint64_t start = position();
+  uint32_t literal_count;
+  uint32_t distance_count;
+  uint32_t code_count;
+  if (!bits(5, &literal_count) || !bits(5, &distance_count) || !bits(4, &code_count))
+    return false;
+  literal_count += 257;
+  distance_count += 1;
+  code_count += 4;
+  if (literal_count > 286 || distance_count > 30)
+    return false;
+
+  uint16_t code_lengths[320];
+  memset(code_lengths, 0, sizeof(code_lengths));
+  for (uint32_t i = 0; i < code_count; i++) {
+    uint32_t length;
+    if (!bits(3, &length))
+      return false;
+    code_lengths[kCodeLengthOrder[i]] = length;
+  }
+  Huffman lengths;
+  if (build(&lengths, code_lengths, 19) != 0)
+    return false;
+
+  uint32_t index = 0;
+  while (index < literal_count + distance_count) {
+    int32_t symbol = decode(lengths);
+    if (symbol < 0)
+      return false;
+    if (symbol < 16) {
+      code_lengths[index++] = symbol;
+      continue;
+    }
+    uint16_t length = 0;
+    uint32_t repeat;
+    if (symbol == 16) {
+      if (index == 0 || !bits(2, &repeat))
+        return false;
+      length = code_lengths[index - 1];
+      repeat += 3;
+    } else if (symbol == 17) {
+      if (!bits(3, &repeat))
+        return false;
+      repeat += 3;
+    } else {
+      if (!bits(7, &repeat))
+        return false;
+      repeat += 11;
+    }
+    if (index + repeat > literal_count + distance_count)
+      return false;
+    while (repeat-- > 0)
+      code_lengths[index++] = length;
+  }
+  if (code_lengths[256] == 0)
+    return false;
+
+  // Incomplete codes are only allowed if they have a single code.
+  Huffman literals;
+  int32_t left = build(&literals, code_lengths, literal_count);
+  if (left < 0 || (left > 0 && literal_count - literals.count[0] != 1))
+    return false;
+  Huffman distances;
+  left = build(&distances, code_lengths + literal_count, distance_count);
+  if (left < 0 || (left > 0 && distance_count - distances.count[0] != 1))
+    return false;
+  overhead_bits_ += position() - start;
+  return codes(literals, distances);
+}
+
+bool Inflater::inflate(ArrayPtr<const uint8_t> compressed) {
+  in_ = compressed;
+  pos_ = 0;
+  bit_buffer_ = 0;
+  bit_count_ = 0;
+  overhead_bits_ = 0;
+  contents_.clear();
+  weights_.clear();
+  literal_count_ = 0;
+  match_count_ = 0;
+  uint32_t last = 0;
+  while (!last) {
+    uint64_t block_start = contents_.size();
+    uint64_t header_start = position();
+    uint32_t type;
+    if (!bits(1, &last) || !bits(2, &type))
+      return false;
+    overhead_bits_ += position() - header_start;
+    bool ok;
+    switch (type) {
+    case 0:
+      ok = stored_block();
+      break;
+    case 1:
+      ok = fixed_block();
+      break;
+    case 2:
+      ok = dynamic_block();
+      break;
+    default:
+      ok = false;
+    }
+    if (!ok)
+      return false;
+    spread_overhead(block_start);
+  }
+  // Whatever is left belongs to blocks that produced nothing, and the padding
+  // to the final byte boundary.
+  overhead_bits_ += bit_count_;
+  spread_overhead(0);
+  for (double &weight : weights_)
+    weight /= 8;
+  return true;
+}
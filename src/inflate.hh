@@ -0,0 +1,74 @@
+#pragma once
+
+#include "heatmap.hh"
+
+#include <kj/common.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace capnprof {
+
+// Inflates a raw deflate stream and works out what each byte of the output
+// cost in the compressed stream, in bytes, according to a heat policy. Block
+// headers and end-of-block codes are spread over the bytes of their block,
+// so the weights add up to the size of the stream.
+//
+// zipprof only exposes literal contributions, so for the match-aware
+// policies we decode the stream ourselves to see where the matches are.
+class Inflater {
+public:
+  explicit Inflater(HeatPolicy policy);
+
+  // Returns false if the stream is malformed or truncated.
+  bool inflate(kj::ArrayPtr<const uint8_t> compressed);
+
+  const std::vector<uint8_t> &contents() const { return contents_; }
+  const std::vector<double> &weights() const { return weights_; }
+  uint64_t literal_count() const { return literal_count_; }
+  uint64_t match_count() const { return match_count_; }
+
+private:
+  static const uint32_t kMaxBits = 15;
+  static const uint32_t kMaxSymbols = 288;
+
+  // A canonical Huffman code, as the number of codes of each length and the
+  // symbols ordered by code.
+  struct Huffman {
+    uint16_t count[kMaxBits + 1];
+    uint16_t symbol[kMaxSymbols];
+  };
+
+  // The codes of blocks compressed with fixed codes.
+  struct FixedCodes {
+    FixedCodes();
+    Huffman lengths;
+    Huffman distances;
+  };
+
+  static int32_t build(Huffman *huffman, const uint16_t *lengths, uint32_t count);
+  bool bits(uint32_t need, uint32_t *out);
+  int32_t decode(const Huffman &huffman);
+  uint64_t position() const { return pos_ * 8 - bit_count_; }
+
+  bool stored_block();
+  bool fixed_block();
+  bool dynamic_block();
+  bool codes(const Huffman &lengths, const Huffman &distances);
+  void charge_match(uint64_t dest, uint32_t length, uint32_t distance, double bits);
+  void spread_overhead(uint64_t block_start);
+
+  HeatPolicy policy_;
+  kj::ArrayPtr<const uint8_t> in_;
+  uint64_t pos_;
+  uint32_t bit_buffer_;
+  uint32_t bit_count_;
+  // Header and end-of-block bits not charged to any byte yet.
+  double overhead_bits_;
+  std::vector<uint8_t> contents_;
+  std::vector<double> weights_;
+  uint64_t literal_count_;
+  uint64_t match_count_;
+};
+
+} // namespace capnprof
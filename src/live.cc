@@ -0,0 +1,157 @@
+#include "live.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <unordered_map>
+
+using namespace capnprof;
+using namespace capnp;
+using namespace kj;
+
+static std::atomic<uint64_t> next_id(0);
+
+// Each thread counts the calls to each live profiler on its own, so
+// sampling never contends on a shared counter and profilers don't skew each
+// other's rate.
+static thread_local std::unordered_map<uint64_t, uint32_t> sample_counters;
+
+LiveProfiler::LiveProfiler(StructSchema schema)
+    : schema_(schema)
+    , id_(next_id++)
+    , sample_rate_(1000)
+    , trace_depth_(4)
+    , max_traces_(0)
+    , snapshot_interval_(60000)
+    , sampled_(0)
+    , dropped_(0)
+    , is_stopping_(false) {
+  set_shard_count(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+LiveProfiler::~LiveProfiler() {
+  stop();
+}
+
+LiveProfiler &LiveProfiler::set_sample_rate(uint32_t value) {
+  sample_rate_ = std::max(1u, value);
+  return *this;
+}
+
+LiveProfiler &LiveProfiler::set_shard_count(uint32_t value) {
+  shards_.clear();
+  for (uint32_t i = 0; i < std::max(1u, value); i++) {
+    shards_.emplace_back(new Shard());
+    shards_.back()->profiler.set_trace_depth(trace_depth_);
+    shards_.back()->profiler.set_max_traces(max_traces_);
+  }
+  return *this;
+}
+
+LiveProfiler &LiveProfiler::set_trace_depth(uint32_t value) {
+  trace_depth_ = value;
+  for (auto &shard : shards_)
+    shard->profiler.set_trace_depth(value);
+  return *this;
+}
+
+LiveProfiler &LiveProfiler::set_max_traces(uint32_t value) {
+  max_traces_ = value;
+  for (auto &shard : shards_)
+    shard->profiler.set_max_traces(value);
+  snapshot_.set_max_traces(value);
+  return *this;
+}
+
+LiveProfiler &LiveProfiler::set_snapshot_interval(std::chrono::milliseconds value) {
+  snapshot_interval_ = value;
+  return *this;
+}
+
+LiveProfiler &LiveProfiler::set_snapshot_callback(SnapshotCallback value) {
+  snapshot_callback_ = value;
+  return *this;
+}
+
+LiveProfiler &LiveProfiler::set_snapshot_file(std::string value) {
+  snapshot_file_ = value;
+  return *this;
+}
+
+void LiveProfiler::start() {
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  if (thread_.joinable())
+    return;
+  is_stopping_ = false;
+  thread_ = std::thread(&LiveProfiler::run, this);
+}
+
+void LiveProfiler::stop() {
+  {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    if (!thread_.joinable())
+      return;
+    is_stopping_ = true;
+  }
+  control_cond_.notify_all();
+  thread_.join();
+}
+
+void LiveProfiler::run() {
+  std::unique_lock<std::mutex> lock(control_mutex_);
+  while (true) {
+    if (control_cond_.wait_for(lock, snapshot_interval_, [this] { return is_stopping_; }))
+      break;
+    lock.unlock();
+    snapshot();
+    lock.lock();
+  }
+}
+
+void LiveProfiler::sample(ArrayPtr<const word> data) {
+  if (++sample_counters[id_] % sample_rate_ != 0)
+    return;
+  uint32_t shard_count = shards_.size();
+  uint32_t first = std::hash<std::thread::id>()(std::this_thread::get_id()) % shard_count;
+  for (uint32_t i = 0; i < shard_count; i++) {
+    Shard &shard = *shards_[(first + i) % shard_count];
+    std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+      continue;
+    try {
+      shard.profiler.profile(schema_, data);
+      sampled_.fetch_add(1, std::memory_order_relaxed);
+    } catch (kj::Exception&) {
+      // A message we can't read is no reason to disturb the caller.
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LiveProfiler::snapshot() {
+  std::lock_guard<std::mutex> lock(snapshot_mutex_);
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> shard_lock(shard->mutex);
+    snapshot_.merge(shard->profiler);
+    shard->profiler.clear();
+  }
+  export_snapshot();
+}
+
+void LiveProfiler::export_snapshot() {
+  if (snapshot_callback_)
+    snapshot_callback_(snapshot_);
+  if (snapshot_file_.empty())
+    return;
+  // Write to the side and then move into place so readers never see a
+  // partial snapshot.
+  std::string temp_file = snapshot_file_ + ".tmp";
+  FILE *out = fopen(temp_file.c_str(), "w");
+  if (out == NULL)
+    return;
+  snapshot_.dump(Trace::Order::ACCUM_BYTES, false, 0xFFFFFFFF, 0, out);
+  fclose(out);
+  rename(temp_file.c_str(), snapshot_file_.c_str());
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "prof.hh"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace capnprof {
+
+// A profiler that can be embedded in a running service. Messages can be passed
+// to sample() from any number of threads and 1 in every N of them is profiled
+// into one of a set of shards, each with its own lock. A caller that can't get
+// any shard right away drops the sample rather than wait. Every so often the
+// shards are folded into a cumulative snapshot which is passed to the snapshot
+// callback and/or written to the snapshot file.
+//
+// The setters must be called before start().
+class LiveProfiler {
+public:
+  typedef std::function<void(Profiler &snapshot)> SnapshotCallback;
+
+  LiveProfiler(capnp::StructSchema schema);
+  ~LiveProfiler();
+
+  LiveProfiler &set_sample_rate(uint32_t value);
+  LiveProfiler &set_shard_count(uint32_t value);
+  LiveProfiler &set_trace_depth(uint32_t value);
+  // Caps the traces of each shard and of the snapshot, see
+  // Profiler::set_max_traces.
+  LiveProfiler &set_max_traces(uint32_t value);
+  LiveProfiler &set_snapshot_interval(std::chrono::milliseconds value);
+  LiveProfiler &set_snapshot_callback(SnapshotCallback value);
+  LiveProfiler &set_snapshot_file(std::string value);
+
+  // Starts and stops the thread that takes snapshots.
+  void start();
+  void stop();
+
+  // Profiles the given flat message, as produced by messageToFlatArray, if
+  // it is selected by sampling.
+  void sample(kj::ArrayPtr<const capnp::word> data);
+
+  // Folds the shards into the snapshot and exports it.
+  void snapshot();
+
+  uint64_t sampled() const { return sampled_.load(std::memory_order_relaxed); }
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  struct Shard {
+    std::mutex mutex;
+    Profiler profiler;
+  };
+
+  void run();
+  void export_snapshot();
+
+  capnp::StructSchema schema_;
+  // Tells this profiler's sample counters apart from other instances'.
+  uint64_t id_;
+  uint32_t sample_rate_;
+  uint32_t trace_depth_;
+  uint32_t max_traces_;
+  std::chrono::milliseconds snapshot_interval_;
+  SnapshotCallback snapshot_callback_;
+  std::string snapshot_file_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  std::atomic<uint64_t> sampled_;
+  std::atomic<uint64_t> dropped_;
+
+  std::mutex snapshot_mutex_;
+  Profiler snapshot_;
+
+  std::mutex control_mutex_;
+  std::condition_variable control_cond_;
+  bool is_stopping_;
+  std::thread thread_;
+};
+
+} // namespace capnprof
@@ -0,0 +1,150 @@
+#include "lz.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+using namespace capnprof;
+using namespace kj;
+
+bool LzConfig::parse(std::string spec, LzConfig *out) {
+  size_t equals = spec.find('=');
+  if (equals == std::string::npos || equals == 0)
+    return false;
+  out->name = spec.substr(0, equals);
+  std::vector<std::string> parts;
+  size_t start = equals + 1;
+  while (true) {
+    size_t colon = spec.find(':', start);
+    parts.push_back(spec.substr(start, colon - start));
+    if (colon == std::string::npos)
+      break;
+    start = colon + 1;
+  }
+  if (parts.size() > 3)
+    return false;
+
+  char *end;
+  unsigned long window = strtoul(parts[0].c_str(), &end, 10);
+  std::string suffix = end;
+  if (suffix == "K") {
+    window <<= 10;
+  } else if (suffix == "M") {
+    window <<= 20;
+  } else if (!suffix.empty()) {
+    return false;
+  }
+  if (end == parts[0].c_str() || window == 0 || window > (1u << 30))
+    return false;
+  out->window = window;
+  if (parts.size() > 1) {
+    unsigned long min_match = strtoul(parts[1].c_str(), &end, 10);
+    if (*end != '\0' || min_match < 3 || min_match > 16)
+      return false;
+    out->min_match = min_match;
+  }
+  if (parts.size() > 2) {
+    if (parts[2] == "raw") {
+      out->literals = Literals::RAW;
+    } else if (parts[2] == "entropy") {
+      out->literals = Literals::ENTROPY;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+LzSimulator::LzSimulator(const LzConfig &config)
+    : config_(config)
+    , literal_count_(0)
+    , match_count_(0) { }
+
+uint32_t LzSimulator::hash(const uint8_t *bytes) const {
+  uint32_t value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+  if (config_.min_match >= 4)
+    value |= static_cast<uint32_t>(bytes[3]) << 24;
+  return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+double LzSimulator::gamma_bits(uint32_t value) {
+  uint32_t log = 0;
+  while ((value >> log) > 1)
+    log += 1;
+  return 2 * log + 1;
+}
+
+void LzSimulator::compress(ArrayPtr<const uint8_t> data) {
+  weights_.assign(data.size(), 0);
+  literal_count_ = 0;
+  match_count_ = 0;
+  // The hash is over up to four bytes so shorter tails are always literals.
+  uint32_t hash_bytes = std::min<uint32_t>(config_.min_match, 4);
+  std::vector<int64_t> head(1 << kHashBits, -1);
+  std::vector<int64_t> chain(data.size(), -1);
+  std::vector<bool> is_literal(data.size(), false);
+  uint64_t literal_counts[256] = {};
+  auto insert = [&](uint64_t pos) {
+    if (pos + hash_bytes > data.size())
+      return;
+    uint32_t key = hash(data.begin() + pos);
+    chain[pos] = head[key];
+    head[key] = pos;
+  };
+
+  uint64_t pos = 0;
+  while (pos < data.size()) {
+    uint32_t best_length = 0;
+    uint64_t best_distance = 0;
+    if (pos + config_.min_match <= data.size()) {
+      uint64_t limit = std::min<uint64_t>(data.size() - pos, kMaxMatch);
+      int64_t candidate = head[hash(data.begin() + pos)];
+      for (uint32_t i = 0; i < kMaxChain && candidate >= 0; i++) {
+        uint64_t distance = pos - candidate;
+        if (distance > config_.window)
+          break;
+        uint32_t length = 0;
+        while (length < limit && data[candidate + length] == data[pos + length])
+          length += 1;
+        if (length > best_length) {
+          best_length = length;
+          best_distance = distance;
+        }
+        candidate = chain[candidate];
+      }
+    }
+    if (best_length >= config_.min_match) {
+      double bits = 1 + gamma_bits(best_distance)
+          + gamma_bits(best_length - config_.min_match + 1);
+      for (uint32_t i = 0; i < best_length; i++) {
+        weights_[pos + i] = bits / best_length / 8;
+        insert(pos + i);
+      }
+      pos += best_length;
+      match_count_ += 1;
+    } else {
+      is_literal[pos] = true;
+      literal_counts[data[pos]] += 1;
+      insert(pos);
+      pos += 1;
+      literal_count_ += 1;
+    }
+  }
+
+  // Literals are charged once their frequencies are known.
+  for (uint64_t i = 0; i < data.size(); i++) {
+    if (!is_literal[i])
+      continue;
+    double bits = 8;
+    if (config_.literals == LzConfig::Literals::ENTROPY)
+      bits = -std::log2(static_cast<double>(literal_counts[data[i]]) / literal_count_);
+    weights_[i] = (1 + bits) / 8;
+  }
+}
+
+double LzSimulator::total_bytes() const {
+  double result = 0;
+  for (double weight : weights_)
+    result += weight;
+  return result;
+}
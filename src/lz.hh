@@ -0,0 +1,65 @@
+#pragma once
+
+#include <kj/common.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace capnprof {
+
+// A codec for the LZ77 simulator to compress messages with, to see how
+// traces would fare under codecs other than deflate.
+struct LzConfig {
+  enum class Literals {
+    // Each literal costs a byte, like LZ4.
+    RAW,
+    // Each literal costs its order-0 entropy among the message's literals,
+    // like the Huffman coded literals of zstd.
+    ENTROPY
+  };
+
+  std::string name;
+  uint32_t window;
+  uint32_t min_match;
+  Literals literals;
+
+  LzConfig() : window(1 << 16), min_match(4), literals(Literals::ENTROPY) { }
+
+  // Parses NAME=WINDOW[:MIN_MATCH[:raw|entropy]], where the window may have
+  // a K or M suffix.
+  static bool parse(std::string spec, LzConfig *out);
+};
+
+// A greedy LZ77 parser with hash chains that charges each byte of its input
+// with what it costs in the simulated output, in bytes. Literals cost a flag
+// bit plus their literal coding. Matches cost a flag bit plus Elias gamma
+// coded distances and lengths, spread evenly over the bytes they produce.
+// This is nowhere near a real encoder but tracks how window size, minimum
+// match and literal coding change where the bytes go.
+class LzSimulator {
+public:
+  explicit LzSimulator(const LzConfig &config);
+
+  void compress(kj::ArrayPtr<const uint8_t> data);
+
+  const std::vector<double> &weights() const { return weights_; }
+  double total_bytes() const;
+  uint64_t literal_count() const { return literal_count_; }
+  uint64_t match_count() const { return match_count_; }
+
+private:
+  static const uint32_t kHashBits = 16;
+  static const uint32_t kMaxChain = 64;
+  static const uint32_t kMaxMatch = 1 << 16;
+
+  uint32_t hash(const uint8_t *bytes) const;
+  static double gamma_bits(uint32_t value);
+
+  LzConfig config_;
+  std::vector<double> weights_;
+  uint64_t literal_count_;
+  uint64_t match_count_;
+};
+
+} // namespace capnprof
@@ -1,12 +1,17 @@
 // Copyright (c) 2018 Tundra. All right reserved.
 // Use of this code is governed by the terms defined in LICENSE.md.
 
+#include "budget.hh"
+#include "pipeline.hh"
 #include "prof.hh"
 
 #include <argp.h>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <memory>
+#include <thread>
 
 using namespace capnprof;
 
@@ -21,39 +26,140 @@ private:
   static error_t dispatch_parse_option(int key, char *arg, argp_state *state);
   error_t parse_option(int key, char *arg, argp_state *state);
 
-  static const argp_option kOptions[9];
+  static const argp_option kOptions[37];
   static const argp kParser;
 
   std::vector<std::string> import_paths;
   std::vector<std::string> args;
+  std::vector<TypeMapping> type_mappings;
+  std::vector<EntryRule> entry_rules;
+  std::vector<LzConfig> lz_configs;
   std::string type;
   std::string schema;
+  std::string compiled_schema;
   std::string order;
+  std::string stats_path;
+  std::string cache_dir;
+  std::string state_path;
+  std::string budget_path;
+  std::string baseline_path;
+  std::string scope;
   uint32_t depth;
+  uint32_t refine_depth;
+  double refine_threshold;
   uint32_t count;
+  uint32_t max_traces;
+  int32_t column_level;
+  uint32_t threads;
+  uint32_t readers;
+  uint32_t inflaters;
+  // Files read ahead of the traversal. Zero profiles each file in turn.
+  uint32_t readahead;
+  HeatPolicy heat_policy;
   double cutoff;
   bool reverse;
+  bool fold;
+  bool show_entries;
+  bool canonical;
+  bool blobs;
+  bool stats;
+  bool split_data;
+  bool slots;
+  bool by_type;
 };
 
 Arguments::Arguments()
     : order("accum")
     , depth(5)
+    , refine_depth(0)
+    , refine_threshold(0.01)
     , count(0xFFFFFFFF)
+    , max_traces(0)
+    , column_level(-2)
+    , threads(std::max(1u, std::thread::hardware_concurrency()))
+    , readers(1)
+    , inflaters(std::max(1u, std::thread::hardware_concurrency()))
+    , readahead(0)
+    , heat_policy(HeatPolicy::LITERAL)
     , cutoff(0)
-    , reverse(false) { }
+    , reverse(false)
+    , fold(false)
+    , show_entries(false)
+    , canonical(false)
+    , blobs(false)
+    , stats(false)
+    , split_data(false)
+    , slots(false)
+    , by_type(false) { }
 
 const argp_option Arguments::kOptions[] = {
     {"import-path", 'I', "PATH", 0, ""},
     {"type", 't', "TYPE", 0, ""},
     {"schema", 's', "SCHEMA", 0, ""},
+    {"compiled-schema", 'S', "FILE", 0, ""},
     {"depth", 'd', "DEPTH", 0, ""},
+    {"scope", 'p', "PATH", 0, ""},
+    {"refine", 'R', "DEPTH", 0, ""},
+    {"refine-threshold", 'T', "FRACTION", 0, ""},
     {"count", 'c', "COUNT", 0, ""},
     {"cutoff", 'x', "CUTOFF", 0, ""},
+    {"max-traces", 'm', "COUNT", 0, ""},
     {"order", 'o', "ORDER", 0, ""},
     {"reverse", 'r', 0, 0, ""},
+    {"fold", 'F', 0, 0, ""},
+    {"split-data", 'D', 0, 0, ""},
+    {"slots", 'N', 0, 0, ""},
+    {"by-type", 'Y', 0, 0, ""},
+    {"any-type", 'a', "FIELD[DISC=VALUE]=TYPE", 0, ""},
+    {"any-types", 'A', "FILE", 0, ""},
+    {"entry-type", 'e', "PATTERN=TYPE", 0, ""},
+    {"skip", 'k', "PATTERN", 0, ""},
+    {"entries", 'E', 0, 0, ""},
+    {"canonical", 'C', 0, 0, ""},
+    {"blobs", 'B', 0, 0, ""},
+    {"columns", 'L', "LEVEL", 0, ""},
+    {"threads", 'j', "COUNT", 0, ""},
+    {"readers", 'i', "COUNT", 0, ""},
+    {"inflaters", 'n', "COUNT", 0, ""},
+    {"readahead", 'f', "FILES", 0, ""},
+    {"cache", 'K', "DIR", 0, ""},
+    {"state", 'U', "FILE", 0, ""},
+    {"heat", 'H', "POLICY", 0, ""},
+    {"lz", 'z', "NAME=WINDOW[:MIN_MATCH[:raw|entropy]]", 0, ""},
+    {"budget", 'b', "FILE", 0, ""},
+    {"baseline", 'g', "STATE", 0, ""},
+    {"stats", 'P', "FILE", OPTION_ARG_OPTIONAL, ""},
     {NULL}
 };
 
+// Parses a type mapping of the form Struct.field=Type or
+// Struct.field[disc=value]=Type.
+static bool parse_type_mapping(std::string spec, TypeMapping *out) {
+  size_t type_start = spec.rfind('=');
+  if (type_start == std::string::npos)
+    return false;
+  out->type = spec.substr(type_start + 1);
+  std::string field = spec.substr(0, type_start);
+  size_t disc_start = field.find('[');
+  if (disc_start != std::string::npos) {
+    if (field.back() != ']')
+      return false;
+    std::string disc = field.substr(disc_start + 1, field.size() - disc_start - 2);
+    field = field.substr(0, disc_start);
+    size_t value_start = disc.find('=');
+    if (value_start == std::string::npos)
+      return false;
+    out->discriminant = disc.substr(0, value_start);
+    out->value = disc.substr(value_start + 1);
+  }
+  size_t field_start = field.rfind('.');
+  if (field_start == std::string::npos)
+    return false;
+  out->struct_name = field.substr(0, field_start);
+  out->field_name = field.substr(field_start + 1);
+  return !out->type.empty() && !out->struct_name.empty() && !out->field_name.empty();
+}
+
 error_t Arguments::dispatch_parse_option(int key, char *arg, struct argp_state *state) {
   return static_cast<Arguments*>(state->input)->parse_option(key, arg, state);
 }
@@ -69,21 +175,145 @@ error_t Arguments::parse_option(int key, char *arg, struct argp_state *state) {
   case 's':
     schema = arg;
     break;
+  case 'S':
+    compiled_schema = arg;
+    break;
   case 'd':
     depth = atoi(arg);
     break;
+  case 'R':
+    refine_depth = atoi(arg);
+    break;
+  case 'T':
+    refine_threshold = atof(arg);
+    break;
   case 'c':
     count = atoi(arg);
     break;
   case 'x':
     cutoff = atof(arg);
     break;
+  case 'm':
+    max_traces = atoi(arg);
+    break;
   case 'o':
     order = arg;
     break;
   case 'r':
     reverse = true;
     break;
+  case 'F':
+    fold = true;
+    break;
+  case 'D':
+    split_data = true;
+    break;
+  case 'N':
+    slots = true;
+    break;
+  case 'p':
+    scope = arg;
+    break;
+  case 'Y':
+    by_type = true;
+    break;
+  case 'a': {
+    TypeMapping mapping;
+    if (!parse_type_mapping(arg, &mapping))
+      argp_error(state, "Invalid type mapping '%s'", arg);
+    type_mappings.push_back(mapping);
+    break;
+  }
+  case 'A': {
+    std::ifstream file(arg);
+    if (!file)
+      argp_error(state, "Couldn't open type mappings file '%s'", arg);
+    std::string line;
+    while (std::getline(file, line)) {
+      size_t start = line.find_first_not_of(" \t");
+      if (start == std::string::npos || line[start] == '#')
+        continue;
+      size_t end = line.find_last_not_of(" \t\r");
+      std::string spec = line.substr(start, end - start + 1);
+      TypeMapping mapping;
+      if (!parse_type_mapping(spec, &mapping))
+        argp_error(state, "Invalid type mapping '%s' in %s", spec.c_str(), arg);
+      type_mappings.push_back(mapping);
+    }
+    break;
+  }
+  case 'e': {
+    std::string spec = arg;
+    size_t type_start = spec.rfind('=');
+    if (type_start == std::string::npos || type_start + 1 == spec.size())
+      argp_error(state, "Invalid entry type '%s'", arg);
+    entry_rules.push_back({spec.substr(0, type_start), spec.substr(type_start + 1)});
+    break;
+  }
+  case 'k':
+    entry_rules.push_back({arg, ""});
+    break;
+  case 'E':
+    show_entries = true;
+    break;
+  case 'C':
+    canonical = true;
+    break;
+  case 'B':
+    blobs = true;
+    break;
+  case 'L':
+    column_level = atoi(arg);
+    break;
+  case 'j':
+    threads = std::max(1, atoi(arg));
+    break;
+  case 'i':
+    readers = std::max(1, atoi(arg));
+    break;
+  case 'n':
+    inflaters = std::max(1, atoi(arg));
+    break;
+  case 'f':
+    readahead = std::max(0, atoi(arg));
+    break;
+  case 'K':
+    cache_dir = arg;
+    break;
+  case 'U':
+    state_path = arg;
+    break;
+  case 'b':
+    budget_path = arg;
+    break;
+  case 'g':
+    baseline_path = arg;
+    break;
+  case 'H':
+    if (strcmp(arg, "literal") == 0) {
+      heat_policy = HeatPolicy::LITERAL;
+    } else if (strcmp(arg, "match") == 0) {
+      heat_policy = HeatPolicy::MATCH;
+    } else if (strcmp(arg, "source") == 0) {
+      heat_policy = HeatPolicy::MATCH_SOURCE;
+    } else {
+      argp_error(state, "Invalid heat policy '%s'", arg);
+    }
+    break;
+  case 'z': {
+    LzConfig config;
+    if (!LzConfig::parse(arg, &config))
+      argp_error(state, "Invalid codec '%s'", arg);
+    if (lz_configs.size() >= InputMap::kMaxSims)
+      argp_error(state, "At most %u codecs can be simulated", InputMap::kMaxSims);
+    lz_configs.push_back(config);
+    break;
+  }
+  case 'P':
+    stats = true;
+    if (arg != NULL)
+      stats_path = arg;
+    break;
   case ARGP_KEY_ARG:
     args.push_back(arg);
     break;
@@ -106,38 +336,78 @@ public:
   int main(kj::ArrayPtr<char*> cmdline);
 
 private:
-  void profile_files();
+  bool profile_files();
+  void profile_archives(Profiler &profiler);
+  void write_stats(const RunStats &stats);
+  bool check_budget(Budget &budget, Profiler &profiler);
+  void configure(Profiler &profiler);
   Trace::Order parse_order(std::string str);
 
   Arguments &args() { return args_; }
   Arguments args_;
 };
 
-static std::string read_file(std::string path) {
-  std::stringstream bytes;
-  std::ifstream file(path, std::ios::binary);
-  if (!file) {
-    std::cerr << "Couldn't open file " << path << std::endl;
-    return std::string();
-  }
-  bytes << file.rdbuf();
-  file.close();
-  return bytes.str();
-}
-
-void CapnProf::profile_files() {
-  Profiler profiler;
+void CapnProf::configure(Profiler &profiler) {
   for (std::string import_path : args().import_paths)
     profiler.add_include_path(import_path);
-  profiler.parse_schema(args().schema);
+  if (!args().schema.empty())
+    profiler.parse_schema(args().schema);
+  if (!args().compiled_schema.empty())
+    profiler.load_schema(args().compiled_schema);
   profiler.set_trace_depth(args().depth);
-  for (std::string arg : args().args) {
-    std::string content_str = read_file(arg);
-    kj::ArrayPtr<const uint8_t> contents(
-        reinterpret_cast<const uint8_t*>(content_str.c_str()),
-        content_str.size());
-    profiler.profile_archive(args().type, contents);
+  profiler.set_scope(args().scope);
+  profiler.set_fold_recursion(args().fold);
+  profiler.set_split_data(args().split_data);
+  profiler.set_heat_policy(args().heat_policy);
+  profiler.set_cache_dir(args().cache_dir);
+  profiler.set_slot_stats(args().slots);
+  profiler.set_type_rollup(args().by_type);
+  profiler.set_max_traces(args().max_traces);
+  profiler.set_canonical_what_if(args().canonical);
+  profiler.set_sketch_blobs(args().blobs);
+  profiler.set_gather_columns(args().column_level >= -1);
+  for (TypeMapping mapping : args().type_mappings)
+    profiler.add_type_mapping(mapping);
+  for (EntryRule rule : args().entry_rules)
+    profiler.add_entry_rule(rule);
+  for (const LzConfig &config : args().lz_configs)
+    profiler.add_lz_config(config);
+}
+
+bool CapnProf::profile_files() {
+  Budget budget;
+  std::string error;
+  if (!args().budget_path.empty() && !budget.load(args().budget_path, &error)) {
+    std::cerr << error << std::endl;
+    return false;
+  }
+  if (budget.has_relative_rules() && args().baseline_path.empty()) {
+    std::cerr << "Relative budgets need a --baseline" << std::endl;
+    return false;
   }
+  Profiler profiler;
+  configure(profiler);
+  if (!args().state_path.empty()) {
+    // Refining starts over from scratch, which defeats the point of a state.
+    if (args().refine_depth > args().depth) {
+      std::cerr << "--state can't be used with --refine" << std::endl;
+      return false;
+    }
+    if (std::ifstream(args().state_path) && !profiler.load_state(args().state_path))
+      return false;
+  }
+  profile_archives(profiler);
+  if (!args().state_path.empty() && !profiler.save_state(args().state_path))
+    return false;
+  if (args().refine_depth > args().depth) {
+    // Profile everything again, this time tracing the hot paths found by the
+    // first pass to the deeper depth.
+    profiler.refine(args().refine_depth, args().refine_threshold);
+    profile_archives(profiler);
+  }
+  if (args().column_level >= -1)
+    profiler.compress_columns(args().column_level, args().threads);
+  RunStats::Timer output_timer(profiler.run_stats(), RunStats::Stage::OUTPUT);
   uint32_t cutoff_bytes;
   if (args().cutoff == 0) {
     cutoff_bytes = 0;
@@ -146,6 +416,73 @@ void CapnProf::profile_files() {
     cutoff_bytes = static_cast<uint32_t>(total_bytes * args().cutoff);
   }
   profiler.dump(parse_order(args().order), args().reverse, args().count, cutoff_bytes);
+  if (args().show_entries)
+    profiler.dump_entries(args().count);
+  if (args().slots)
+    profiler.dump_slots(args().count);
+  if (args().by_type)
+    profiler.dump_types(args().count);
+  if (!args().lz_configs.empty())
+    profiler.dump_sims(parse_order(args().order), args().reverse, args().count);
+  if (args().blobs)
+    profiler.dump_blobs(args().count);
+  if (args().column_level >= -1)
+    profiler.dump_columns(args().count);
+  if (args().canonical)
+    profiler.dump_canonical(parse_order(args().order), args().reverse, args().count);
+  output_timer.stop();
+  if (args().stats)
+    write_stats(profiler.run_stats());
+  if (!args().budget_path.empty())
+    return check_budget(budget, profiler);
+  return true;
+}
+
+bool CapnProf::check_budget(Budget &budget, Profiler &profiler) {
+  std::unique_ptr<Profiler> baseline;
+  if (!args().baseline_path.empty()) {
+    baseline.reset(new Profiler());
+    configure(*baseline);
+    if (!baseline->load_state(args().baseline_path))
+      return false;
+  }
+  std::vector<BudgetViolation> violations = budget.check(profiler, baseline.get());
+  Budget::print(violations);
+  return violations.empty();
+}
+
+void CapnProf::write_stats(const RunStats &stats) {
+  if (args().stats_path.empty()) {
+    stats.print(stderr);
+    return;
+  }
+  std::ofstream file(args().stats_path);
+  if (!file) {
+    std::cerr << "Couldn't open file " << args().stats_path << std::endl;
+    return;
+  }
+  stats.write_json(file);
+}
+
+void CapnProf::profile_archives(Profiler &profiler) {
+  if (args().readahead > 0) {
+    ArchivePipeline pipeline(profiler);
+    pipeline.set_reader_count(args().readers)
+        .set_inflater_count(args().inflaters)
+        .set_readahead(args().readahead);
+    pipeline.run(args().type, args().args);
+    return;
+  }
+  // Without readahead each file is read and profiled in turn.
+  for (std::string arg : args().args) {
+    RunStats::Timer read_timer(profiler.run_stats(), RunStats::Stage::READ);
+    std::string content_str = ArchivePipeline::read_file(arg);
+    read_timer.stop();
+    kj::ArrayPtr<const uint8_t> contents(
+        reinterpret_cast<const uint8_t*>(content_str.c_str()),
+        content_str.size());
+    profiler.profile_archive(args().type, contents, arg);
+  }
 }
 
 Trace::Order CapnProf::parse_order(std::string str) {
@@ -163,6 +500,18 @@ Trace::Order CapnProf::parse_order(std::string str) {
     return Trace::Order::SELF_FACTOR;
   } else if (str == "zaccum%") {
     return Trace::Order::ACCUM_FACTOR;
+  } else if (str == "lines") {
+    return Trace::Order::SELF_LINES;
+  } else if (str == "pages") {
+    return Trace::Order::SELF_PAGES;
+  } else if (str == "dist") {
+    return Trace::Order::MEAN_DISTANCE;
+  } else if (str == "null") {
+    return Trace::Order::NULL_SLOT_BYTES;
+  } else if (str == "selfreads") {
+    return Trace::Order::SELF_READ_COST;
+  } else if (str == "reads") {
+    return Trace::Order::ACCUM_READ_COST;
   } else {
     return Trace::Order::SERIAL;
   }
@@ -170,8 +519,7 @@ Trace::Order CapnProf::parse_order(std::string str) {
 
 int CapnProf::main(kj::ArrayPtr<char*> cmdline) {
   args().parse(cmdline);
-  profile_files();
-  return 0;
+  return profile_files() ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {
@@ -0,0 +1,163 @@
+#include "pipeline.hh"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+using namespace capnprof;
+
+ArchivePipeline::ArchivePipeline(Profiler &profiler)
+    : profiler_(profiler)
+    , reader_count_(1)
+    , inflater_count_(1)
+    , readahead_(4)
+    , entry_buffer_(4)
+    , paths_(NULL)
+    , next_read_(0)
+    , next_publish_(0)
+    , is_failed_(false) { }
+
+ArchivePipeline &ArchivePipeline::set_reader_count(uint32_t value) {
+  reader_count_ = std::max(1u, value);
+  return *this;
+}
+
+ArchivePipeline &ArchivePipeline::set_inflater_count(uint32_t value) {
+  inflater_count_ = std::max(1u, value);
+  return *this;
+}
+
+ArchivePipeline &ArchivePipeline::set_readahead(uint32_t value) {
+  readahead_ = std::max(1u, value);
+  return *this;
+}
+
+ArchivePipeline &ArchivePipeline::set_entry_buffer(uint32_t value) {
+  entry_buffer_ = std::max(1u, value);
+  return *this;
+}
+
+std::string ArchivePipeline::read_file(const std::string &path) {
+  std::stringstream bytes;
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Couldn't open file " << path << std::endl;
+    return std::string();
+  }
+  bytes << file.rdbuf();
+  file.close();
+  return bytes.str();
+}
+
+void ArchivePipeline::fail(std::exception_ptr error) {
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  if (!error_)
+    error_ = error;
+  is_failed_ = true;
+}
+
+void ArchivePipeline::read(RunStats &run_stats) {
+  while (true) {
+    uint32_t index;
+    {
+      std::lock_guard<std::mutex> lock(order_mutex_);
+      index = next_read_++;
+    }
+    if (index >= paths_->size())
+      return;
+    FilePtr file(new PendingFile((*paths_)[index], entry_buffer_));
+    if (!is_failed_) {
+      RunStats::Timer timer(run_stats, RunStats::Stage::READ);
+      file->contents = read_file(file->path);
+    }
+    // Files can be read out of order but are handed on in order.
+    {
+      std::unique_lock<std::mutex> lock(order_mutex_);
+      order_changed_.wait(lock, [&] { return next_publish_ == index; });
+    }
+    file_queue_->push(file);
+    read_queue_->push(file);
+    if (index + 1 == paths_->size()) {
+      read_queue_->close();
+      file_queue_->close();
+    }
+    {
+      std::lock_guard<std::mutex> lock(order_mutex_);
+      next_publish_ += 1;
+    }
+    order_changed_.notify_all();
+  }
+}
+
+void ArchivePipeline::inflate(RunStats &run_stats) {
+  // Files are taken in order, so the file being traversed is always either
+  // waiting to be taken or being inflated, and the pipeline can't stall on a
+  // full entry queue.
+  FilePtr file;
+  while (read_queue_->pop(&file)) {
+    if (!is_failed_) {
+      try {
+        kj::ArrayPtr<const uint8_t> contents(
+            reinterpret_cast<const uint8_t*>(file->contents.data()), file->contents.size());
+        BoundedQueue<std::unique_ptr<PreparedEntry>> &entries = file->entries;
+        profiler_.prepare_archive(struct_name_, contents, file->path, known_keys_,
+            run_stats, true, [&entries](std::unique_ptr<PreparedEntry> entry) {
+          entries.push(std::move(entry));
+        });
+      } catch (...) {
+        fail(std::current_exception());
+      }
+    }
+    // The prepared entries have copies of what they need.
+    std::string().swap(file->contents);
+    file->entries.close();
+    file.reset();
+  }
+}
+
+void ArchivePipeline::run(std::string struct_name, const std::vector<std::string> &paths) {
+  if (paths.empty())
+    return;
+  struct_name_ = struct_name;
+  paths_ = &paths;
+  // Traversal adds keys as it goes, so the workers check against a copy and
+  // profile_prepared catches the rest.
+  known_keys_ = profiler_.entry_keys();
+  read_queue_.reset(new BoundedQueue<FilePtr>(readahead_));
+  file_queue_.reset(new BoundedQueue<FilePtr>(readahead_ + reader_count_ + inflater_count_));
+  next_read_ = 0;
+  next_publish_ = 0;
+  error_ = std::exception_ptr();
+  is_failed_ = false;
+
+  std::vector<RunStats> run_stats(reader_count_ + inflater_count_);
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < reader_count_; i++)
+    threads.emplace_back(&ArchivePipeline::read, this, std::ref(run_stats[i]));
+  for (uint32_t i = 0; i < inflater_count_; i++)
+    threads.emplace_back(&ArchivePipeline::inflate, this, std::ref(run_stats[reader_count_ + i]));
+
+  // After a failure everything still has to be drained so the workers can
+  // finish.
+  FilePtr file;
+  while (file_queue_->pop(&file)) {
+    std::unique_ptr<PreparedEntry> entry;
+    while (file->entries.pop(&entry)) {
+      if (is_failed_)
+        continue;
+      try {
+        profiler_.profile_prepared(*entry);
+      } catch (...) {
+        fail(std::current_exception());
+      }
+    }
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+  for (const RunStats &stats : run_stats)
+    profiler_.run_stats().merge(stats);
+  paths_ = NULL;
+  if (error_)
+    std::rethrow_exception(error_);
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "prof.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace capnprof {
+
+// A queue that blocks pushes while it is full and pops while it is empty.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(std::max<size_t>(1, capacity))
+      , is_closed_(false) { }
+
+  // Returns false, dropping the value, if the queue was closed.
+  bool push(T value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return is_closed_ || values_.size() < capacity_; });
+    if (is_closed_)
+      return false;
+    values_.push_back(std::move(value));
+    changed_.notify_all();
+    return true;
+  }
+
+  // Returns false once the queue is closed and empty.
+  bool pop(T *out) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return is_closed_ || !values_.empty(); });
+    if (values_.empty())
+      return false;
+    *out = std::move(values_.front());
+    values_.pop_front();
+    changed_.notify_all();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_closed_ = true;
+    changed_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<T> values_;
+  size_t capacity_;
+  bool is_closed_;
+};
+
+// Profiles a list of archives with reading, inflating and traversing
+// overlapped. Reader threads read files ahead of the rest and hand them on in
+// order, inflater threads prepare their entries with
+// Profiler::prepare_archive, and the calling thread traverses the prepared
+// entries into the profiler, in the same order profile_archive would have,
+// so the results don't depend on the thread counts. Each queue between the
+// stages is bounded, which caps the memory a run can use at roughly
+// readahead + readers + inflaters files and entry_buffer entries per
+// inflated file.
+//
+// Times in the run stats are summed over the threads of each stage, so they
+// can add up to more than the run took.
+class ArchivePipeline {
+public:
+  explicit ArchivePipeline(Profiler &profiler);
+
+  ArchivePipeline &set_reader_count(uint32_t value);
+  ArchivePipeline &set_inflater_count(uint32_t value);
+  // How many read files can wait for an inflater.
+  ArchivePipeline &set_readahead(uint32_t value);
+  // How many prepared entries of a file can wait to be traversed.
+  ArchivePipeline &set_entry_buffer(uint32_t value);
+
+  // Profiles the archives at the given paths as profile_archive does.
+  // Exceptions thrown while preparing or traversing are rethrown once every
+  // thread has stopped.
+  void run(std::string struct_name, const std::vector<std::string> &paths);
+
+  // Returns the contents of the file at the given path, or an empty string
+  // if it can't be read.
+  static std::string read_file(const std::string &path);
+
+private:
+  struct PendingFile {
+    PendingFile(std::string path, uint32_t entry_buffer)
+        : path(path)
+        , entries(entry_buffer) { }
+    std::string path;
+    std::string contents;
+    BoundedQueue<std::unique_ptr<PreparedEntry>> entries;
+  };
+  typedef std::shared_ptr<PendingFile> FilePtr;
+
+  void read(RunStats &run_stats);
+  void inflate(RunStats &run_stats);
+  void fail(std::exception_ptr error);
+
+  Profiler &profiler_;
+  uint32_t reader_count_;
+  uint32_t inflater_count_;
+  uint32_t readahead_;
+  uint32_t entry_buffer_;
+
+  // The state of a run.
+  std::string struct_name_;
+  const std::vector<std::string> *paths_;
+  std::unordered_set<std::string> known_keys_;
+  std::unique_ptr<BoundedQueue<FilePtr>> read_queue_;
+  std::unique_ptr<BoundedQueue<FilePtr>> file_queue_;
+  std::mutex order_mutex_;
+  std::condition_variable order_changed_;
+  uint32_t next_read_;
+  uint32_t next_publish_;
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+  std::atomic<bool> is_failed_;
+};
+
+} // namespace capnprof
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <capnp/common.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace capnprof {
+
+// Decodes a raw pointer word in a message, for the things the dynamic API
+// doesn't tell us: where pointers point and how they get there. Assumes a
+// little-endian host, like the rest of the raw byte handling.
+class RawPointer {
+public:
+  enum class Kind {
+    STRUCT = 0,
+    LIST = 1,
+    FAR_POINTER = 2,
+    OTHER = 3
+  };
+
+  explicit RawPointer(const capnp::word *slot)
+      : slot_(slot) {
+    memcpy(&value_, slot, sizeof(value_));
+  }
+
+  const capnp::word *slot() const { return slot_; }
+  bool is_null() const { return value_ == 0; }
+  Kind kind() const { return static_cast<Kind>(value_ & 0x3); }
+
+  // Struct and list pointers: the signed offset in words from the end of the
+  // pointer to the start of the target.
+  int32_t offset() const { return static_cast<int32_t>(value_ & 0xFFFFFFFF) >> 2; }
+  const capnp::word *target() const { return slot_ + 1 + offset(); }
+
+  // List pointers: the element size code and the element count, which for
+  // inline composite lists is the number of words excluding the tag.
+  uint32_t element_size() const { return static_cast<uint32_t>(value_ >> 32) & 0x7; }
+  uint32_t element_count() const { return static_cast<uint32_t>(value_ >> 35); }
+  bool is_inline_composite() const { return element_size() == 7; }
+
+  // Far pointers: whether the landing pad is itself a far pointer.
+  bool is_double_far() const { return (value_ & 0x4) != 0; }
+
+private:
+  const capnp::word *slot_;
+  uint64_t value_;
+};
+
+} // namespace capnprof
@@ -1,16 +1,33 @@
 #include "prof.hh"
 
+#include "archive.hh"
+#include "inflate.hh"
+#include "pointer.hh"
+#include "state.hh"
+#include "static.hh"
+
 #include "zipprof.h"
 
 #include <capnp/message.h>
+#include <capnp/schema.capnp.h>
 #include <capnp/serialize.h>
 
+#include <fnmatch.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cinttypes>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <unordered_map>
 #include <set>
+#include <thread>
 
 using namespace capnprof;
 using namespace capnp;
@@ -23,32 +40,96 @@ double DeflateHeatMap::weight(uint32_t first_byte, uint32_t limit_byte) {
   return result;
 }
 
+double ArrayHeatMap::weight(uint32_t first_byte, uint32_t limit_byte) {
+  // Summed byte by byte, like DeflateHeatMap, so cached profiles weigh
+  // exactly the same.
+  double result = 0;
+  for (uint32_t i = first_byte; i < limit_byte && i < weights_.size(); i++)
+    result += weights_[i];
+  return result;
+}
+
 InputMap::InputMap(HeatMap &heat_map, kj::ArrayPtr<const capnp::word> data)
     : heat_map_(heat_map)
-    , counts_(new uint8_t[data.size()], data.size())
+    , counts_(new uint8_t[data.size() * sizeof(word)], data.size() * sizeof(word))
     , data_(data) {
   memset(counts_.begin(), 0, counts_.size());
 }
 
 InputMap::~InputMap() {
-  delete counts_.begin();
+  delete[] counts_.begin();
 }
 
 double InputMap::weigh(const void *start, uint32_t size) {
-  KJ_ASSERT(size == word_align(size));
   if (!(data_.begin() <= start && start < data_.end()))
     return 0;
   uint32_t first_byte = reinterpret_cast<const uint8_t*>(start) - reinterpret_cast<const uint8_t*>(data_.begin());
   double weight = heat_map_.weight(first_byte, first_byte + size);
-  uint32_t first_word = first_byte / sizeof(word);
-  uint32_t limit_word = first_word + (size / sizeof(word));
-  for (uint32_t i = first_word; i < limit_word; i++) {
+  for (uint32_t i = first_byte; i < first_byte + size; i++) {
     KJ_ASSERT(counts_[i] == 0);
     counts_[i] += 1;
   }
   return weight;
 }
 
+void InputMap::add_sim(std::unique_ptr<HeatMap> heat_map) {
+  KJ_ASSERT(sims_.size() < kMaxSims);
+  sims_.push_back(std::move(heat_map));
+}
+
+uint32_t InputMap::weigh_sims(const void *start, uint32_t bit_offset, uint32_t bit_count,
+    double *out) {
+  const uint8_t *data = reinterpret_cast<const uint8_t*>(data_.begin());
+  const uint8_t *first = reinterpret_cast<const uint8_t*>(start) + (bit_offset / 8);
+  bool is_inside = data <= first && first < reinterpret_cast<const uint8_t*>(data_.end());
+  for (uint32_t i = 0; i < sims_.size(); i++) {
+    out[i] = 0;
+    uint32_t index = first - data;
+    uint32_t bit = bit_offset % 8;
+    uint32_t count = bit_count;
+    while (is_inside && count > 0) {
+      if (bit == 0 && count >= 8) {
+        out[i] += sims_[i]->weight(index, index + count / 8);
+        index += count / 8;
+        count %= 8;
+      } else {
+        uint32_t part = std::min(8 - bit, count);
+        out[i] += sims_[i]->weight(index, index + 1) * part / 8;
+        index += 1;
+        bit = 0;
+        count -= part;
+      }
+    }
+  }
+  return sims_.size();
+}
+
+double InputMap::weigh_bits(const void *start, uint32_t bit_offset, uint32_t bit_count) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t*>(start);
+  double weight = 0;
+  while (bit_count > 0) {
+    const uint8_t *first = bytes + (bit_offset / 8);
+    uint32_t bit = bit_offset % 8;
+    uint32_t count;
+    if (bit == 0 && bit_count >= 8) {
+      count = (bit_count / 8) * 8;
+      weight += weigh(first, count / 8);
+    } else {
+      // Bytes shared between fields are charged by the bit and not counted,
+      // since more than one field touches them.
+      count = std::min(8 - bit, bit_count);
+      const uint8_t *data = reinterpret_cast<const uint8_t*>(data_.begin());
+      if (data <= first && first < reinterpret_cast<const uint8_t*>(data_.end())) {
+        uint32_t index = first - data;
+        weight += heat_map_.weight(index, index + 1) * count / 8;
+      }
+    }
+    bit_offset += count;
+    bit_count -= count;
+  }
+  return weight;
+}
+
 void Profiler::profile_value(TracePath &path, DynamicValue::Reader reader) {
   switch (reader.getType()) {
     case capnp::DynamicValue::VOID:
@@ -70,17 +151,82 @@ void Profiler::profile_value(TracePath &path, DynamicValue::Reader reader) {
     case capnp::DynamicValue::STRUCT:
       profile_struct(path, reader.as<DynamicStruct>());
       break;
+    case capnp::DynamicValue::ANY_POINTER:
+    case capnp::DynamicValue::CAPABILITY:
+      // Any pointers can only be resolved in the context of their containing
+      // struct, see profile_any_pointer. Capabilities have no content in the
+      // message beyond their pointer.
+      break;
     default:
       std::cout << reader.getType() << std::endl;
       break;
   }
 }
 
+std::string Profiler::value_repr(DynamicValue::Reader value) {
+  switch (value.getType()) {
+    case capnp::DynamicValue::BOOL:
+      return value.as<bool>() ? "true" : "false";
+    case capnp::DynamicValue::INT:
+      return std::to_string(value.as<int64_t>());
+    case capnp::DynamicValue::UINT:
+      return std::to_string(value.as<uint64_t>());
+    case capnp::DynamicValue::TEXT:
+      return value.as<Text>().cStr();
+    case capnp::DynamicValue::ENUM: {
+      DynamicEnum as_enum = value.as<DynamicEnum>();
+      KJ_IF_MAYBE(enumerant, as_enum.getEnumerant())
+        return enumerant->getProto().getName().cStr();
+      return std::to_string(as_enum.getRaw());
+    }
+    default:
+      return "";
+  }
+}
+
+void Profiler::profile_any_pointer(TracePath &path, DynamicStruct::Reader parent,
+    StructSchema::Field field, AnyPointer::Reader reader) {
+  StringPtr struct_name = field.getContainingStruct().getShortDisplayName();
+  StringPtr field_name = field.getProto().getName();
+  for (TypeMapping &mapping : type_mappings_) {
+    if (mapping.struct_name != struct_name.cStr() || mapping.field_name != field_name.cStr())
+      continue;
+    if (!mapping.discriminant.empty()) {
+      KJ_IF_MAYBE(sibling, parent.getSchema().findFieldByName(mapping.discriminant)) {
+        if (value_repr(parent.get(*sibling)) != mapping.value)
+          continue;
+      } else {
+        continue;
+      }
+    }
+    StructSchema schema = find_struct(mapping.type);
+    profile_struct(path, reader.getAs<DynamicStruct>(schema));
+    return;
+  }
+}
+
+ArrayPtr<const byte> Profiler::list_overhead(AnyList::Reader reader) {
+  ElementSize size = reader.getElementSize();
+  if (reader.size() == 0 || (size != ElementSize::POINTER
+      && size != ElementSize::INLINE_COMPOSITE))
+    return nullptr;
+  // Reading the list as structs tells where the first element starts, even
+  // for pointer lists whose elements then read as pointer-only structs.
+  const byte *first = reader.as<List<AnyStruct>>()[0].getDataSection().begin();
+  if (size == ElementSize::POINTER)
+    return ArrayPtr<const byte>(first, reader.size() * sizeof(word));
+  return ArrayPtr<const byte>(first - sizeof(word), sizeof(word));
+}
+
 void Profiler::profile_list(TracePath &path, DynamicList::Reader reader) {
   if (reader.size() == 0)
     return;
   AnyList::Reader any_reader(reader);
   capnp::Type elm_type = reader.getSchema().getElementType();
+  // Every element read is checked against the list size.
+  ReadCost cost;
+  cost.bounds_checks = reader.size();
+  path.add_reads(cost);
   switch (elm_type.which()) {
     case schema::Type::Which::BOOL:
     case schema::Type::Which::INT8:
@@ -102,7 +248,18 @@ void Profiler::profile_list(TracePath &path, DynamicList::Reader reader) {
     case schema::Type::Which::DATA:
     case schema::Type::Which::TEXT:
     case schema::Type::Which::LIST: {
+      ArrayPtr<const byte> overhead = list_overhead(any_reader);
+      if (overhead.size() > 0)
+        path.add_pointers(overhead);
       TracePath inner(path, TraceLink::Type::ARRAY);
+      if (!elm_type.isStruct()) {
+        // The elements are pointers.
+        ReadCost element_cost;
+        element_cost.hops = reader.size();
+        element_cost.bounds_checks = reader.size();
+        element_cost.list_decodes = reader.size();
+        inner.add_reads(element_cost);
+      }
       for (auto value: reader)
         profile_value(inner, value);
       break;
@@ -115,28 +272,231 @@ void Profiler::profile_list(TracePath &path, DynamicList::Reader reader) {
 
 void Profiler::profile_text(TracePath &path, Text::Reader reader) {
   path.add_data(reader.asBytes());
+  path.add_blob(reader.asBytes());
 }
 
 void Profiler::profile_data(TracePath &path, Data::Reader reader) {
   path.add_data(reader.asBytes());
+  path.add_blob(reader.asBytes());
+}
+
+static bool is_pointer_type(capnp::Type type) {
+  switch (type.which()) {
+    case schema::Type::Which::TEXT:
+    case schema::Type::Which::DATA:
+    case schema::Type::Which::LIST:
+    case schema::Type::Which::STRUCT:
+    case schema::Type::Which::INTERFACE:
+    case schema::Type::Which::ANY_POINTER:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the slot that holds the given field in a pointer section, or NULL if
+// the field isn't stored in a pointer slot.
+static const word *pointer_slot(StructSchema::Field field, const word *pointers,
+    uint32_t pointer_count) {
+  schema::Field::Reader proto = field.getProto();
+  if (!proto.isSlot() || !is_pointer_type(field.getType()))
+    return NULL;
+  uint32_t offset = proto.getSlot().getOffset();
+  return (offset < pointer_count) ? (pointers + offset) : NULL;
+}
+
+// Returns true unless the field is a member of a union and isn't the one
+// that's set.
+static bool is_active(DynamicStruct::Reader reader, StructSchema::Field field) {
+  if (field.getProto().getDiscriminantValue() == schema::Field::NO_DISCRIMINANT)
+    return true;
+  KJ_IF_MAYBE(active, reader.which())
+    return *active == field;
+  return false;
+}
+
+ReadCost Profiler::pointer_read_cost(const RawPointer &pointer, bool is_list) {
+  ReadCost cost;
+  if (pointer.is_null() || pointer.kind() == RawPointer::Kind::OTHER)
+    return cost;
+  cost.hops = 1;
+  cost.bounds_checks = 1;
+  if (pointer.kind() == RawPointer::Kind::FAR_POINTER)
+    cost.far_hops = pointer.is_double_far() ? 2 : 1;
+  if (is_list)
+    cost.list_decodes = 1;
+  return cost;
+}
+
+// The number of bits a field of the given type takes up in the data section.
+static uint32_t data_bits(capnp::Type type) {
+  switch (type.which()) {
+    case schema::Type::Which::BOOL:
+      return 1;
+    case schema::Type::Which::INT8:
+    case schema::Type::Which::UINT8:
+      return 8;
+    case schema::Type::Which::INT16:
+    case schema::Type::Which::UINT16:
+    case schema::Type::Which::ENUM:
+      return 16;
+    case schema::Type::Which::INT32:
+    case schema::Type::Which::UINT32:
+    case schema::Type::Which::FLOAT32:
+      return 32;
+    case schema::Type::Which::INT64:
+    case schema::Type::Which::UINT64:
+    case schema::Type::Which::FLOAT64:
+      return 64;
+    default:
+      return 0;
+  }
+}
+
+static const char kPaddingName[] = "(padding)";
+static const char kOutOfScopeName[] = "(out of scope)";
+
+// Returns the size of everything the pointers in a field lead to, found from
+// the pointers alone so the subtree isn't read.
+static uint64_t target_bytes(DynamicStruct::Reader reader, StructSchema::Field field,
+    ArrayPtr<const word> pointers) {
+  if (field.getProto().isGroup()) {
+    DynamicStruct::Reader group = reader.get(field).as<DynamicStruct>();
+    uint64_t bytes = 0;
+    for (auto inner: group.getSchema().getFields()) {
+      if (group.has(inner))
+        bytes += target_bytes(group, inner, pointers);
+    }
+    return bytes;
+  }
+  if (pointer_slot(field, pointers.begin(), pointers.size()) == NULL)
+    return 0;
+  AnyPointer::Reader pointer =
+      AnyStruct::Reader(reader).getPointerSection()[field.getProto().getSlot().getOffset()];
+  return pointer.targetSize().wordCount * sizeof(word);
 }
 
 void Profiler::profile_struct(TracePath &path, DynamicStruct::Reader reader) {
+  // Generated profilers only know the default way of splitting up structs
+  // and always walk every field.
+  if (!static_profilers_.empty() && !split_data_ && !slot_stats_ && scope_.empty()) {
+    uint64_t id = reader.getSchema().getProto().getId();
+    auto function = static_profilers_.find(id);
+    if (function != static_profilers_.end()) {
+      if (structs_by_id_.find(id) == structs_by_id_.end())
+        index_structs(reader.getSchema());
+      StaticContext context(*this);
+      function->second(context, path, reader);
+      return;
+    }
+  }
+  profile_dynamic_struct(path, reader);
+}
+
+void Profiler::profile_dynamic_struct(TracePath &path, DynamicStruct::Reader reader) {
+  path.set_struct(reader.getSchema());
   AnyStruct::Reader any_reader(reader);
   ArrayPtr<const byte> data_section = any_reader.getDataSection();
-  path.add_data(data_section);
+  std::vector<bool> used;
+  if (split_data_) {
+    used.resize(data_section.size() * 8);
+  } else {
+    path.add_data(data_section);
+  }
   uint32_t pointer_count = any_reader.getPointerSection().size();
   ArrayPtr<const byte> pointer_section(word_align(data_section.end()),
       pointer_count * sizeof(word));
   path.add_pointers(pointer_section);
+  ArrayPtr<const word> pointers(reinterpret_cast<const word*>(pointer_section.begin()),
+      pointer_count);
+  profile_fields(path, reader, data_section, pointers, split_data_ ? &used : NULL);
+  if (split_data_) {
+    // Whatever no field claimed is padding, inactive union members or fields
+    // this schema doesn't know about.
+    TracePath padding(path, TraceLink(kPaddingName));
+    uint32_t start = 0;
+    for (uint32_t i = 0; i <= used.size(); i++) {
+      if (i < used.size() && !used[i])
+        continue;
+      padding.add_data_bits(data_section, start, i - start);
+      start = i + 1;
+    }
+  }
+}
+
+void Profiler::profile_slot(TracePath &path, ArrayPtr<const byte> data_section,
+    uint32_t bit_offset, uint32_t bit_count, std::vector<bool> *used) {
+  // Sections written with an older schema may end before the slot.
+  uint32_t limit = std::min<uint32_t>(bit_offset + bit_count, used->size());
+  if (bit_offset >= limit)
+    return;
+  for (uint32_t i = bit_offset; i < limit; i++)
+    (*used)[i] = true;
+  path.add_data_bits(data_section, bit_offset, limit - bit_offset);
+}
+
+void Profiler::profile_fields(TracePath &path, DynamicStruct::Reader reader,
+    ArrayPtr<const byte> data_section, ArrayPtr<const word> pointers,
+    std::vector<bool> *used) {
+  schema::Node::Struct::Reader node = reader.getSchema().getProto().getStruct();
+  if (used != NULL && node.getDiscriminantCount() > 0)
+    profile_slot(path, data_section, node.getDiscriminantOffset() * 16, 16, used);
+  TracePath out_of_scope(path, TraceLink(kOutOfScopeName));
   for (auto field: reader.getSchema().getFields()) {
-    if (!reader.has(field))
+    const word *slot = pointer_slot(field, pointers.begin(), pointers.size());
+    if (!reader.has(field)) {
+      if (slot_stats_ && slot != NULL && is_active(reader, field)) {
+        TracePath inner(path, field);
+        if (inner.in_scope())
+          inner.add_slot(false);
+      }
       continue;
-    DynamicValue::Reader value = reader.get(field);
-    std::stringstream buf;
-    buf << reader.getSchema().getShortDisplayName().cStr() << "." << field.getProto().getName().cStr();
+    }
     TracePath inner(path, field);
-    profile_value(inner, value);
+    // Primitive fields cost nothing to keep since their bits are charged
+    // with the section anyway. The slots of skipped pointers are charged
+    // with the section too and their subtrees are counted in one trace so
+    // the totals still add up.
+    if (!inner.in_scope() && (slot != NULL || field.getProto().isGroup())) {
+      uint64_t bytes = target_bytes(reader, field, pointers);
+      if (bytes > 0) {
+        out_of_scope.add_unwalked_bytes(bytes);
+        // The canonical what-if walks each message again into its own pools.
+        if (&path.context().pool() == &pool_)
+          out_of_scope_bytes_ += bytes;
+      }
+      continue;
+    }
+    DynamicValue::Reader value = reader.get(field);
+    if (field.getProto().isGroup()) {
+      // Groups share the sections of the struct they're in.
+      profile_fields(inner, value.as<DynamicStruct>(), data_section, pointers, used);
+      continue;
+    }
+    uint32_t bits = data_bits(field.getType());
+    if (used != NULL && bits > 0)
+      profile_slot(inner, data_section, field.getProto().getSlot().getOffset() * bits, bits, used);
+    // Reading the field checks it is within the section. For primitive
+    // fields that is charged to the struct so they don't all need a trace.
+    ReadCost cost;
+    cost.bounds_checks = 1;
+    if (slot != NULL) {
+      if (slot_stats_)
+        inner.add_slot(true);
+      RawPointer pointer(slot);
+      if (pointer.kind() == RawPointer::Kind::STRUCT || pointer.kind() == RawPointer::Kind::LIST)
+        inner.add_pointer_distance(static_cast<int64_t>(pointer.offset()) * sizeof(word));
+      capnp::Type type = field.getType();
+      cost += pointer_read_cost(pointer, type.isList() || type.isText() || type.isData());
+      inner.add_reads(cost);
+    } else if (bits > 0) {
+      path.add_reads(cost);
+    }
+    if (value.getType() == DynamicValue::ANY_POINTER) {
+      profile_any_pointer(inner, reader, field, value.as<AnyPointer>());
+    } else {
+      profile_value(inner, value);
+    }
   }
 }
 
@@ -202,19 +562,41 @@ static IdentityHeatMap kIdentityHeatMap;
 Profiler::Profiler()
     : fs_(kj::newDiskFilesystem())
     , trace_depth_(4)
-    , heat_map_(&kIdentityHeatMap) { }
+    , refine_depth_(4)
+    , fold_recursion_(false)
+    , sketch_blobs_(false)
+    , gather_columns_(false)
+    , split_data_(false)
+    , slot_stats_(false)
+    , max_traces_(0)
+    , heat_map_(&kIdentityHeatMap)
+    , heat_policy_(HeatPolicy::LITERAL)
+    , message_bytes_(0)
+    , canonical_message_bytes_(0)
+    , out_of_scope_bytes_(0) { }
 
 Profiler &Profiler::add_include_path(std::string path) {
   include_paths_.push_back(path);
   return *this;
 }
 
+Profiler &Profiler::add_type_mapping(TypeMapping mapping) {
+  type_mappings_.push_back(mapping);
+  return *this;
+}
+
+Profiler &Profiler::add_entry_rule(EntryRule rule) {
+  entry_rules_.push_back(rule);
+  return *this;
+}
+
 Profiler &Profiler::set_heat_map(HeatMap &value) {
   heat_map_ = &value;
   return *this;
 }
 
 Profiler &Profiler::parse_schema(std::string path) {
+  RunStats::Timer timer(run_stats_, RunStats::Stage::SCHEMA);
   std::vector<StringPtr> include_paths;
   for (const std::string &path : include_paths_)
     include_paths.push_back(path.c_str());
@@ -226,11 +608,211 @@ Profiler &Profiler::parse_schema(std::string path) {
   return *this;
 }
 
+Profiler &Profiler::load_schema(std::string path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    std::cerr << "Couldn't open file " << path << std::endl;
+    return *this;
+  }
+  size_t size = file.tellg();
+  kj::Array<word> words = kj::heapArray<word>(size / sizeof(word));
+  file.seekg(0);
+  file.read(reinterpret_cast<char*>(words.begin()), words.size() * sizeof(word));
+  return load_schema(words);
+}
+
+Profiler &Profiler::load_schema(ArrayPtr<const word> data) {
+  RunStats::Timer timer(run_stats_, RunStats::Stage::SCHEMA);
+  ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue;
+  FlatArrayMessageReader message(data, options);
+  schema::CodeGeneratorRequest::Reader request =
+      message.getRoot<schema::CodeGeneratorRequest>();
+  for (schema::Node::Reader node : request.getNodes()) {
+    schema_loader_.load(node);
+    if (!node.isStruct() || node.getStruct().getIsGroup())
+      continue;
+    // Display names are of the form file.capnp:Outer.Inner and we look
+    // structs up by the part after the file name.
+    StringPtr name = node.getDisplayName();
+    KJ_IF_MAYBE(colon, name.findFirst(':'))
+      name = name.slice(*colon + 1);
+    loaded_structs_[name.cStr()] = node.getId();
+  }
+  return *this;
+}
+
+StructSchema Profiler::find_struct(std::string name) {
+  auto iter = loaded_structs_.find(name);
+  if (iter != loaded_structs_.end())
+    return schema_loader_.get(iter->second).asStruct();
+  return parsed_schema_.getNested(name).asStruct();
+}
+
 Profiler &Profiler::set_trace_depth(uint32_t value) {
   trace_depth_ = value;
   return *this;
 }
 
+Profiler &Profiler::set_fold_recursion(bool value) {
+  fold_recursion_ = value;
+  return *this;
+}
+
+Profiler &Profiler::set_scope(std::string value) {
+  scope_spec_ = value;
+  scope_.clear();
+  std::stringstream parts(value);
+  std::string part;
+  while (std::getline(parts, part, '.')) {
+    // Lists are stepped into without a component of their own.
+    while (part.size() >= 2 && part.compare(part.size() - 2, 2, "[]") == 0)
+      part.resize(part.size() - 2);
+    scope_.push_back(part);
+  }
+  return *this;
+}
+
+Profiler &Profiler::set_max_traces(uint32_t value) {
+  max_traces_ = value;
+  pool_.set_max_traces(value);
+  if (canonical_pool_) {
+    canonical_pool_->set_max_traces(value);
+    zipped_pool_->set_max_traces(value);
+  }
+  return *this;
+}
+
+Profiler &Profiler::set_sketch_blobs(bool value) {
+  sketch_blobs_ = value;
+  return *this;
+}
+
+Profiler &Profiler::set_gather_columns(bool value) {
+  gather_columns_ = value;
+  return *this;
+}
+
+Profiler &Profiler::set_split_data(bool value) {
+  split_data_ = value;
+  return *this;
+}
+
+Profiler &Profiler::set_slot_stats(bool value) {
+  slot_stats_ = value;
+  return *this;
+}
+
+Profiler &Profiler::set_heat_policy(HeatPolicy value) {
+  heat_policy_ = value;
+  return *this;
+}
+
+Profiler &Profiler::set_type_rollup(bool value) {
+  if (!value) {
+    rollup_.reset();
+  } else if (!rollup_) {
+    rollup_.reset(new TypeRollup());
+  }
+  return *this;
+}
+
+Profiler &Profiler::add_lz_config(const LzConfig &config) {
+  KJ_ASSERT(lz_configs_.size() < InputMap::kMaxSims, "Too many simulated codecs");
+  lz_configs_.push_back(config);
+  return *this;
+}
+
+Profiler &Profiler::set_cache_dir(std::string dir) {
+  if (dir.empty()) {
+    cache_.reset();
+  } else {
+    cache_.reset(new ProfileCache(dir));
+  }
+  return *this;
+}
+
+Profiler &Profiler::add_static_profiler(uint64_t struct_id, StaticProfileFunction function) {
+  static_profilers_[struct_id] = function;
+  return *this;
+}
+
+void Profiler::index_structs(StructSchema schema) {
+  if (!structs_by_id_.emplace(schema.getProto().getId(), schema).second)
+    return;
+  for (auto field : schema.getFields()) {
+    capnp::Type type = field.getType();
+    while (type.isList())
+      type = type.asList().getElementType();
+    if (type.isStruct())
+      index_structs(type.asStruct());
+  }
+}
+
+void Profiler::index_all_structs() {
+  for (Schema schema : schema_loader_.getAllLoaded()) {
+    if (schema.getProto().isStruct())
+      index_structs(schema.asStruct());
+  }
+  index_parsed(parsed_schema_);
+}
+
+void Profiler::index_parsed(ParsedSchema schema) {
+  if (schema.getProto().isStruct())
+    index_structs(schema.asStruct());
+  for (auto nested : schema.getProto().getNestedNodes())
+    index_parsed(schema.getNested(nested.getName()));
+}
+
+StructSchema Profiler::struct_by_id(uint64_t id) {
+  auto schema = structs_by_id_.find(id);
+  KJ_ASSERT(schema != structs_by_id_.end(), "Struct not reachable from a profiled root", id);
+  return schema->second;
+}
+
+Profiler &Profiler::set_canonical_what_if(bool value) {
+  if (!value) {
+    canonical_pool_.reset();
+    zipped_pool_.reset();
+  } else if (!canonical_pool_) {
+    canonical_pool_.reset(new TracePool());
+    canonical_pool_->set_max_traces(max_traces_);
+    zipped_pool_.reset(new TracePool());
+    zipped_pool_->set_max_traces(max_traces_);
+  }
+  return *this;
+}
+
+void Profiler::canonical_traces(Trace::Order order, bool reverse,
+    std::vector<Trace*> *traces_out) {
+  if (canonical_pool_)
+    canonical_pool_->flush(order, reverse, traces_out);
+}
+
+void Profiler::zipped_traces(Trace::Order order, bool reverse,
+    std::vector<Trace*> *traces_out) {
+  if (zipped_pool_)
+    zipped_pool_->flush(order, reverse, traces_out);
+}
+
+Profiler &Profiler::refine(uint32_t depth, double threshold) {
+  double min_weight = root().stats().accum_weight() * threshold;
+  // Hashes of different paths can collide, so the hot paths themselves are
+  // kept and compared link by link.
+  hot_traces_.clear();
+  for (auto entry : pool_.traces_) {
+    Trace *trace = entry.second;
+    if (trace->depth() == trace_depth_ && trace->stats().accum_weight() >= min_weight)
+      hot_traces_.get_or_create(*trace);
+  }
+  refine_depth_ = depth;
+  // The first pass is still part of the run.
+  RunStats run_stats = run_stats_;
+  clear();
+  run_stats_ = run_stats;
+  return *this;
+}
+
 void Profiler::traces(Trace::Order order, bool reverse, std::vector<Trace*> *traces_out) {
   pool_.flush(order, reverse, traces_out);
 }
@@ -240,41 +822,475 @@ Trace &Profiler::root() {
   return TracePath(context).trace();
 }
 
+RunStats &Profiler::run_stats() {
+  RunStats::PoolCounters counters;
+  counters.lookups = pool_.lookups();
+  counters.hits = pool_.hits();
+  counters.created = pool_.created();
+  counters.peak_traces = pool_.peak_size();
+  counters.peak_bytes = pool_.peak_bytes();
+  run_stats_.set_pool_counters(counters);
+  return run_stats_;
+}
+
+void Profiler::merge(Profiler &that) {
+  pool_.merge(that.pool_);
+  if (rollup_ && that.rollup_)
+    rollup_->merge(*that.rollup_);
+  run_stats_.merge(that.run_stats_);
+}
+
+void Profiler::clear() {
+  pool_.clear();
+  entries_.clear();
+  entry_keys_.clear();
+  if (canonical_pool_) {
+    canonical_pool_->clear();
+    zipped_pool_->clear();
+  }
+  if (rollup_)
+    rollup_->clear();
+  message_bytes_ = 0;
+  canonical_message_bytes_ = 0;
+  out_of_scope_bytes_ = 0;
+  run_stats_ = RunStats();
+}
+
+// Bump the version when the layout changes or traces are charged differently,
+// so old states are refused rather than mixed with new ones.
+static const char kStateMagic[8] = {'C', 'P', 'R', 'O', 'F', 'S', 'T', 'A'};
+static const uint32_t kStateVersion = 4;
+// Paths deeper than this mean the state is corrupt.
+static const uint32_t kMaxStateDepth = 1 << 16;
+
+// Identifies an archive entry across runs. Entries are only ever appended so
+// the same name, checksum and offset means the same contents.
+static std::string entry_key(const std::string &archive, const std::string &name, uint32_t crc,
+    uint64_t header_offset) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ":%08x:%" PRIx64, crc, header_offset);
+  return archive + ":" + name + suffix;
+}
+
+bool Profiler::save_state(std::string path) {
+  std::vector<Trace*> traces;
+  pool_.flush(Trace::Order::SERIAL, false, &traces);
+  // Write to the side and then move into place so a run that dies halfway
+  // doesn't destroy the previous state.
+  std::string temp_path = path + ".tmp";
+  bool ok;
+  {
+    std::ofstream file(temp_path, std::ios::binary);
+    StateWriter out(file);
+    out.write(kStateMagic);
+    out.write(kStateVersion);
+    out.write(trace_depth_);
+    out.write(fold_recursion_);
+    out.write(split_data_);
+    out.write(slot_stats_);
+    out.write(static_cast<uint8_t>(heat_policy_));
+    out.write_string(scope_spec_);
+    out.write(static_cast<uint64_t>(entries_.size()));
+    for (const EntrySummary &entry : entries_) {
+      out.write_string(entry.archive);
+      out.write_string(entry.name);
+      out.write_string(entry.type);
+      out.write(entry.crc);
+      out.write(entry.header_offset);
+      out.write(entry.raw_bytes);
+      out.write(entry.compressed_bytes);
+      out.write(entry.weight);
+    }
+    out.write(static_cast<uint64_t>(traces.size()));
+    for (const Trace *trace : traces) {
+      out.write(trace->depth());
+      for (const TraceLink &link : trace->path()) {
+        out.write(static_cast<uint8_t>(link.type()));
+        if (link.type() == TraceLink::Type::STRUCT_FIELD) {
+          const StructSchema::Field *field = link.as_struct_field();
+          out.write(field->getContainingStruct().getProto().getId());
+          out.write(static_cast<uint32_t>(field->getIndex()));
+        } else if (link.type() == TraceLink::Type::STRING) {
+          out.write_string(link.repr());
+        }
+      }
+      trace->stats().write(out);
+    }
+    ok = out.ok();
+  }
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+    remove(temp_path.c_str());
+    std::cerr << "Couldn't write state " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Profiler::read_link(StateReader &in, TraceLink *out) {
+  uint8_t type;
+  if (!in.read(&type))
+    return false;
+  switch (static_cast<TraceLink::Type>(type)) {
+  case TraceLink::Type::ARRAY:
+    *out = TraceLink(TraceLink::Type::ARRAY);
+    return true;
+  case TraceLink::Type::STRUCT_FIELD: {
+    uint64_t struct_id;
+    uint32_t index;
+    if (!in.read(&struct_id) || !in.read(&index))
+      return false;
+    auto schema = structs_by_id_.find(struct_id);
+    if (schema == structs_by_id_.end() || index >= schema->second.getFields().size()) {
+      std::cerr << "Saved state refers to a field that isn't in the schema" << std::endl;
+      return false;
+    }
+    *out = TraceLink(schema->second.getFields()[index]);
+    return true;
+  }
+  case TraceLink::Type::STRING: {
+    std::string name;
+    if (!in.read_string(&name))
+      return false;
+    // Links point to their names so they need to live as long as we do.
+    *out = TraceLink(link_names_.insert(name).first->c_str());
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+bool Profiler::load_state(std::string path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Couldn't open file " << path << std::endl;
+    return false;
+  }
+  StateReader in(file);
+  char magic[sizeof(kStateMagic)];
+  uint32_t version;
+  if (!in.read(&magic) || memcmp(magic, kStateMagic, sizeof(kStateMagic)) != 0
+      || !in.read(&version) || version != kStateVersion) {
+    std::cerr << path << " isn't a state saved by this version" << std::endl;
+    return false;
+  }
+  uint32_t trace_depth;
+  bool fold_recursion;
+  bool split_data;
+  bool slot_stats;
+  uint8_t heat_policy;
+  std::string scope;
+  in.read(&trace_depth);
+  in.read(&fold_recursion);
+  in.read(&split_data);
+  in.read(&slot_stats);
+  in.read(&heat_policy);
+  in.read_string(&scope);
+  if (!in.ok() || trace_depth != trace_depth_ || fold_recursion != fold_recursion_
+      || split_data != split_data_ || slot_stats != slot_stats_
+      || heat_policy != static_cast<uint8_t>(heat_policy_) || scope != scope_spec_) {
+    std::cerr << path << " was saved with different trace settings" << std::endl;
+    return false;
+  }
+  index_all_structs();
+
+  // Read everything before adding any of it, so a bad state changes nothing.
+  uint64_t entry_count = 0;
+  in.read(&entry_count);
+  std::vector<EntrySummary> entries;
+  for (uint64_t i = 0; i < entry_count && in.ok(); i++) {
+    EntrySummary entry;
+    in.read_string(&entry.archive);
+    in.read_string(&entry.name);
+    in.read_string(&entry.type);
+    in.read(&entry.crc);
+    in.read(&entry.header_offset);
+    in.read(&entry.raw_bytes);
+    in.read(&entry.compressed_bytes);
+    in.read(&entry.weight);
+    entries.push_back(entry);
+  }
+  uint64_t trace_count = 0;
+  in.read(&trace_count);
+  std::vector<std::unique_ptr<Trace>> traces;
+  bool ok = in.ok();
+  for (uint64_t i = 0; i < trace_count && ok; i++) {
+    uint32_t depth;
+    ok = in.read(&depth) && depth <= kMaxStateDepth;
+    kj::Array<TraceLink> links = kj::heapArray<TraceLink>(ok ? depth : 0);
+    for (uint32_t j = 0; j < links.size() && ok; j++)
+      ok = read_link(in, &links[j]);
+    if (!ok)
+      break;
+    std::unique_ptr<Trace> trace(new Trace(links.asConst(), 0));
+    ok = trace->stats().read(in);
+    traces.push_back(std::move(trace));
+  }
+  if (!ok) {
+    std::cerr << "Couldn't read state " << path << std::endl;
+    return false;
+  }
+
+  for (const std::unique_ptr<Trace> &trace : traces)
+    pool_.get_or_create(*trace).absorb(*trace);
+  for (const EntrySummary &entry : entries) {
+    entries_.push_back(entry);
+    entry_keys_.insert(entry_key(entry.archive, entry.name, entry.crc, entry.header_offset));
+  }
+  return true;
+}
+
 void Profiler::profile(std::string struct_name, ArrayPtr<const word> data) {
+  profile(find_struct(struct_name), data);
+}
+
+void Profiler::profile(StructSchema schema, ArrayPtr<const word> data) {
   InputMap input_map(*heat_map_, data);
+  for (std::unique_ptr<HeatMap> &sim : simulate(data, run_stats_))
+    input_map.add_sim(std::move(sim));
   TraceContext context(trace_depth_, pool_, &input_map);
-  profile_with_context(struct_name, data, context);
+  configure(context);
+  profile_with_context(schema, data, context);
+}
+
+void Profiler::profile_archive(std::string struct_name, ArrayPtr<const uint8_t> data,
+    std::string archive_name) {
+  prepare_archive(struct_name, data, archive_name, entry_keys_, run_stats_, false,
+      [this](std::unique_ptr<PreparedEntry> entry) {
+    profile_prepared(*entry);
+  });
 }
 
-void Profiler::profile_archive(std::string struct_name, ArrayPtr<const uint8_t> data) {
+void Profiler::prepare_archive(std::string struct_name, ArrayPtr<const uint8_t> data,
+    std::string archive_name, const std::unordered_set<std::string> &known_keys,
+    RunStats &run_stats, bool keeps_entries, PreparedEntrySink sink) {
+  ArchiveIndex index(data);
   zipprof::Archive archive(zipprof::Array<const uint8_t>(data.begin(), data.size()));
   for (std::string path : archive.entries()) {
-    zipprof::DeflateProfile profile = archive.profile(path);
-    zipprof::Array<const uint8_t> bytes = profile.contents();
-    ArrayPtr<const word> words(reinterpret_cast<const word*>(bytes.begin()),
-        bytes.size() /  sizeof(word));
-    DeflateHeatMap heat_map(profile);
-    InputMap input_map(heat_map, words);
-    TraceContext context(trace_depth_, pool_, &input_map);
-    profile_with_context(struct_name, words, context);
+    std::string type = struct_name;
+    for (const EntryRule &rule : entry_rules_) {
+      if (fnmatch(rule.pattern.c_str(), path.c_str(), 0) == 0) {
+        type = rule.type;
+        break;
+      }
+    }
+    if (type.empty())
+      continue;
+    const ArchiveEntry *entry = index.find(path);
+    std::unique_ptr<PreparedEntry> prepared(new PreparedEntry());
+    if (entry != NULL) {
+      prepared->key = entry_key(archive_name, path, entry->crc, entry->header_offset);
+      if (known_keys.count(prepared->key) > 0) {
+        run_stats.add_skipped_entry();
+        continue;
+      }
+    }
+    EntrySummary &summary = prepared->summary;
+    summary.archive = archive_name;
+    summary.name = path;
+    summary.type = type;
+    summary.crc = (entry == NULL) ? 0 : entry->crc;
+    summary.header_offset = (entry == NULL) ? 0 : entry->header_offset;
+    summary.compressed_bytes = (entry == NULL) ? 0 : entry->compressed_size;
+    RunStats::Timer inflate_timer(run_stats, RunStats::Stage::INFLATE);
+    CachedProfile &cached = prepared->profile;
+    bool has_weights = cache_ && entry != NULL && cache_->load(*entry, heat_policy_, &cached);
+    if (!has_weights && heat_policy_ != HeatPolicy::LITERAL && entry != NULL) {
+      has_weights = inflate_entry(index, *entry, &cached);
+      if (has_weights && cache_) {
+        cache_->store(*entry, heat_policy_, ArrayPtr<const uint8_t>(
+            reinterpret_cast<const uint8_t*>(cached.contents.begin()), cached.size),
+            cached.weights);
+      }
+    }
+    ArrayPtr<const word> words = cached.contents.slice(0, cached.size / sizeof(word));
+    std::unique_ptr<zipprof::DeflateProfile> profile;
+    if (!has_weights) {
+      profile.reset(new zipprof::DeflateProfile(archive.profile(path)));
+      zipprof::Array<const uint8_t> bytes = profile->contents();
+      cached.size = bytes.size();
+      if (keeps_entries || (cache_ && entry != NULL)) {
+        // zipprof's literal contributions, copied out so the profile can go.
+        cached.weights.resize(bytes.size());
+        for (uint32_t i = 0; i < bytes.size(); i++)
+          cached.weights[i] = profile->literal_contribution(i);
+        if (cache_ && entry != NULL) {
+          cache_->store(*entry, HeatPolicy::LITERAL,
+              ArrayPtr<const uint8_t>(bytes.begin(), bytes.size()), cached.weights);
+        }
+      }
+      if (keeps_entries) {
+        uint64_t word_count = (cached.size + sizeof(word) - 1) / sizeof(word);
+        cached.contents = kj::heapArray<word>(word_count);
+        memset(cached.contents.begin(), 0, word_count * sizeof(word));
+        memcpy(cached.contents.begin(), bytes.begin(), cached.size);
+        words = cached.contents.slice(0, cached.size / sizeof(word));
+      } else {
+        prepared->deflate_profile = profile.get();
+        words = ArrayPtr<const word>(reinterpret_cast<const word*>(bytes.begin()),
+            bytes.size() / sizeof(word));
+      }
+    }
+    inflate_timer.stop();
+    summary.raw_bytes = cached.size;
+    prepared->sims = simulate(words, run_stats);
+    sink(std::move(prepared));
+  }
+}
+
+void Profiler::profile_prepared(PreparedEntry &entry) {
+  // The same entry may have been prepared twice before it was first
+  // profiled.
+  if (!entry.key.empty() && entry_keys_.count(entry.key) > 0) {
+    run_stats_.add_skipped_entry();
+    return;
+  }
+  run_stats_.add_entry();
+  StructSchema schema = find_struct(entry.summary.type);
+  if (entry.deflate_profile != NULL) {
+    zipprof::Array<const uint8_t> bytes = entry.deflate_profile->contents();
+    DeflateHeatMap heat_map(*entry.deflate_profile);
+    entry.summary.weight = profile_entry(schema, ArrayPtr<const word>(
+        reinterpret_cast<const word*>(bytes.begin()), bytes.size() / sizeof(word)),
+        heat_map, std::move(entry.sims));
+  } else {
+    ArrayHeatMap heat_map(std::move(entry.profile.weights));
+    entry.summary.weight = profile_entry(schema,
+        entry.profile.contents.slice(0, entry.profile.size / sizeof(word)), heat_map,
+        std::move(entry.sims));
+  }
+  entries_.push_back(entry.summary);
+  if (!entry.key.empty())
+    entry_keys_.insert(entry.key);
+}
+
+bool Profiler::inflate_entry(const ArchiveIndex &index, const ArchiveEntry &entry,
+    CachedProfile *out) {
+  const uint16_t kStored = 0;
+  const uint16_t kDeflated = 8;
+  ArrayPtr<const uint8_t> compressed = index.compressed_contents(entry);
+  Inflater inflater(heat_policy_);
+  const uint8_t *contents;
+  if (compressed.size() != entry.compressed_size) {
+    return false;
+  } else if (entry.method == kStored) {
+    contents = compressed.begin();
+    out->weights.assign(compressed.size(), 1);
+  } else if (entry.method == kDeflated && inflater.inflate(compressed)) {
+    contents = inflater.contents().data();
+    out->weights = inflater.weights();
+  } else {
+    std::cerr << "Couldn't inflate " << entry.name << ", using literal weights" << std::endl;
+    return false;
+  }
+  out->size = out->weights.size();
+  uint64_t word_count = (out->size + sizeof(word) - 1) / sizeof(word);
+  out->contents = kj::heapArray<word>(word_count);
+  memset(out->contents.begin(), 0, word_count * sizeof(word));
+  memcpy(out->contents.begin(), contents, out->size);
+  return true;
+}
+
+double Profiler::profile_entry(StructSchema schema, ArrayPtr<const word> words,
+    HeatMap &heat_map, std::vector<std::unique_ptr<HeatMap>> sims) {
+  InputMap input_map(heat_map, words);
+  for (std::unique_ptr<HeatMap> &sim : sims)
+    input_map.add_sim(std::move(sim));
+  TraceContext context(trace_depth_, pool_, &input_map);
+  configure(context);
+  double weight_before = root().stats().accum_weight();
+  profile_with_context(schema, words, context);
+  return root().stats().accum_weight() - weight_before;
+}
+
+std::vector<std::unique_ptr<HeatMap>> Profiler::simulate(ArrayPtr<const word> words,
+    RunStats &run_stats) {
+  std::vector<std::unique_ptr<HeatMap>> sims;
+  if (lz_configs_.empty())
+    return sims;
+  RunStats::Timer timer(run_stats, RunStats::Stage::SIMULATE);
+  ArrayPtr<const uint8_t> bytes(reinterpret_cast<const uint8_t*>(words.begin()),
+      words.size() * sizeof(word));
+  for (const LzConfig &config : lz_configs_) {
+    LzSimulator simulator(config);
+    simulator.compress(bytes);
+    sims.emplace_back(new ArrayHeatMap(simulator.weights()));
   }
+  return sims;
+}
+
+void Profiler::configure(TraceContext &context) {
+  context.set_refinement(refine_depth_, &hot_traces_);
+  context.set_fold_recursion(fold_recursion_);
+  context.set_sketch_blobs(sketch_blobs_);
+  context.set_gather_columns(gather_columns_);
+  context.set_scope(scope_.empty() ? NULL : &scope_);
+  context.set_rollup(rollup_.get());
 }
 
-void Profiler::profile_with_context(std::string struct_name,
+void Profiler::profile_with_context(StructSchema schema,
     kj::ArrayPtr<const capnp::word> data, TraceContext &context) {
-  ParsedSchema schema = parsed_schema_.getNested(struct_name);
   capnp::FlatArrayMessageReader message(data);
-  capnp::DynamicStruct::Reader reader = message.getRoot<capnp::DynamicStruct>(schema.asStruct());
-  TracePath root(context);
-  profile_struct(root, reader);
+  capnp::DynamicStruct::Reader reader = message.getRoot<capnp::DynamicStruct>(schema);
+  message_bytes_ += data.size() * sizeof(word);
+  run_stats_.add_message(data.size());
+  profile_root(reader, context);
+  if (canonical_pool_)
+    profile_canonical(reader, data);
+}
+
+void Profiler::profile_root(DynamicStruct::Reader reader, TraceContext &context) {
+  RunStats::Timer timer(run_stats_, RunStats::Stage::TRAVERSE);
+  {
+    TracePath root(context);
+    // Getting the root means following the root pointer.
+    ReadCost cost;
+    cost.hops = 1;
+    cost.bounds_checks = 1;
+    root.add_reads(cost);
+    profile_struct(root, reader);
+  }
+  context.clear_footprint();
+  // Only trim once no paths refer to the traces anymore.
+  context.pool().trim();
+}
+
+void Profiler::profile_canonical(DynamicStruct::Reader reader, ArrayPtr<const word> data) {
+  RunStats::Timer timer(run_stats_, RunStats::Stage::CANONICAL);
+  // The canonical form is a single segment without a segment table.
+  kj::Array<word> canonical = AnyStruct::Reader(reader).canonicalize();
+  canonical_message_bytes_ += canonical.size() * sizeof(word);
+  ArrayPtr<const word> segments[1] = {canonical};
+  SegmentArrayMessageReader message(kj::arrayPtr(segments, 1));
+  timer.stop();
+  profile_zipped(reader, data, *zipped_pool_);
+  profile_zipped(message.getRoot<DynamicStruct>(reader.getSchema()), canonical,
+      *canonical_pool_);
+}
+
+void Profiler::profile_zipped(DynamicStruct::Reader reader, ArrayPtr<const word> data,
+    TracePool &pool) {
+  RunStats::Timer timer(run_stats_, RunStats::Stage::CANONICAL);
+  ArrayPtr<const char> chars = data.asBytes().asChars();
+  zipprof::DeflateProfile profile = zipprof::Profiler::profile_string(
+      std::string(chars.begin(), chars.size()),
+      zipprof::Compressor::zlib_best_compression());
+  DeflateHeatMap heat_map(profile);
+  InputMap input_map(heat_map, data);
+  TraceContext context(trace_depth_, pool, &input_map);
+  configure(context);
+  // The rollup is of the original encoding as profiled.
+  context.set_rollup(NULL);
+  timer.stop();
+  profile_root(reader, context);
 }
 
 void Profiler::dump(Trace::Order order, bool reverse, uint32_t limit,
-    uint32_t cutoff_bytes) {
+    uint32_t cutoff_bytes, FILE *out) {
   std::vector<Trace*> traces;
   pool_.flush(order, reverse, &traces);
   uint32_t rank = 1;
-  fprintf(stdout, "rank #trc     self    accum    zself   zaccum   zself%%  zaccum%% path\n");
+  fprintf(out, "rank #trc     self    accum    zself   zaccum   zself%%  zaccum%%  lines  pages     dist    reads path\n");
   std::set<uint32_t> serials_seen;
   for (Trace* trace : traces) {
     if (rank > limit) {
@@ -293,23 +1309,377 @@ void Profiler::dump(Trace::Order order, bool reverse, uint32_t limit,
     format_weight(stats.self_weight(), self_weight, 32);
     char accum_weight[32];
     format_weight(stats.accum_weight(), accum_weight, 32);
+    char distance[32];
+    format_bytes(static_cast<uint32_t>(fabs(stats.mean_distance())), distance, 32);
     buf << *trace;
     std::string path = buf.str();
     const char *dots = (path.size() > 32) ? "..." : "";
-    fprintf(stdout, "%4i %4i %8s %8s %8s %8s %7.1f%% %7.1f%% %.32s%s\n", rank,
+    fprintf(out, "%4i %4i %8s %8s %8s %8s %7.1f%% %7.1f%% %6i %6i %8s %8.0f %.32s%s\n", rank,
         trace->serial(), self_bytes, accum_bytes, self_weight, accum_weight,
-        stats.self_factor() * 100, stats.accum_factor() * 100, path.c_str(),
-        dots);
+        stats.self_factor() * 100, stats.accum_factor() * 100, stats.self_lines(),
+        stats.self_pages(), distance, stats.accum_read_cost(), path.c_str(), dots);
     rank += 1;
   }
-  fprintf(stdout, "\n");
+  if (pool_.evicted_count() > 0) {
+    char error[32];
+    format_weight(pool_.eviction_error(), error, 32);
+    fprintf(out, "(%i traces evicted into (other); traces created since may be missing up "
+        "to %s zaccum)\n", pool_.evicted_count(), error);
+  }
+  if (!scope_.empty()) {
+    char traced_bytes[32];
+    format_bytes(root().stats().accum_bytes() - out_of_scope_bytes_, traced_bytes, 32);
+    char skipped_bytes[32];
+    format_bytes(out_of_scope_bytes_, skipped_bytes, 32);
+    char total_bytes[32];
+    format_bytes(message_bytes_, total_bytes, 32);
+    fprintf(out, "(scope %s: %s traced and %s out of scope of %s in messages)\n",
+        scope_spec_.c_str(), traced_bytes, skipped_bytes, total_bytes);
+  }
+  fprintf(out, "\n");
 
   traces.clear();
   pool_.flush(Trace::Order::SERIAL, false, &traces);
   for (Trace *trace : traces) {
     if (serials_seen.find(trace->serial()) == serials_seen.end())
       continue;
-    trace->print(std::cout);
-    std::cout << std::endl;
+    std::stringstream buf;
+    trace->print(buf);
+    fprintf(out, "%s\n", buf.str().c_str());
+  }
+}
+
+void Profiler::dump_entries(uint32_t limit, FILE *out) {
+  std::vector<const EntrySummary*> entries;
+  for (const EntrySummary &entry : entries_)
+    entries.push_back(&entry);
+  std::sort(entries.begin(), entries.end(), [](const EntrySummary *a, const EntrySummary *b) {
+    return a->weight > b->weight;
+  });
+  uint32_t rank = 1;
+  fprintf(out, "rank     size    zsize   weight  weight%% type entry\n");
+  for (const EntrySummary *entry : entries) {
+    if (rank > limit)
+      break;
+    char raw_bytes[32];
+    format_bytes(entry->raw_bytes, raw_bytes, 32);
+    char compressed_bytes[32];
+    format_bytes(entry->compressed_bytes, compressed_bytes, 32);
+    char weight[32];
+    format_weight(entry->weight, weight, 32);
+    std::string name = entry->archive.empty() ? entry->name : (entry->archive + ":" + entry->name);
+    fprintf(out, "%4i %8s %8s %8s %7.1f%% %s %s\n", rank, raw_bytes,
+        compressed_bytes, weight, Stats::safediv(entry->weight, entry->raw_bytes) * 100,
+        entry->type.c_str(), name.c_str());
+    rank += 1;
+  }
+  fprintf(out, "\n");
+}
+
+void Profiler::dump_canonical(Trace::Order order, bool reverse, uint32_t limit, FILE *out) {
+  if (!canonical_pool_)
+    return;
+  char original_total[32];
+  format_bytes(message_bytes_, original_total, 32);
+  char canonical_total[32];
+  format_bytes(canonical_message_bytes_, canonical_total, 32);
+  fprintf(out, "messages: %s, canonical: %s, saved %.1f%%\n", original_total,
+      canonical_total, (1 - Stats::safediv(canonical_message_bytes_, message_bytes_)) * 100);
+  // Both sides are zipped message by message, so the weights differ from
+  // the main report's.
+  std::vector<Trace*> traces;
+  zipped_pool_->flush(order, reverse, &traces);
+  uint32_t rank = 1;
+  fprintf(out, "rank #trc    accum   caccum   zaccum  czaccum   saved%%  zsaved%% path\n");
+  for (Trace *trace : traces) {
+    if (rank > limit)
+      break;
+    Stats &stats = trace->stats();
+    Trace *canonical_trace = canonical_pool_->find(*trace);
+    Stats canonical_stats = (canonical_trace == NULL) ? Stats() : canonical_trace->stats();
+    char accum_bytes[32];
+    format_bytes(stats.accum_bytes(), accum_bytes, 32);
+    char canonical_accum_bytes[32];
+    format_bytes(canonical_stats.accum_bytes(), canonical_accum_bytes, 32);
+    char accum_weight[32];
+    format_weight(stats.accum_weight(), accum_weight, 32);
+    char canonical_accum_weight[32];
+    format_weight(canonical_stats.accum_weight(), canonical_accum_weight, 32);
+    double saved = 1 - Stats::safediv(canonical_stats.accum_bytes(), stats.accum_bytes());
+    double zsaved = 1 - Stats::safediv(canonical_stats.accum_weight(), stats.accum_weight());
+    std::stringstream buf;
+    buf << *trace;
+    std::string path = buf.str();
+    const char *dots = (path.size() > 32) ? "..." : "";
+    fprintf(out, "%4i %4i %8s %8s %8s %8s %7.1f%% %7.1f%% %.32s%s\n", rank,
+        trace->serial(), accum_bytes, canonical_accum_bytes, accum_weight,
+        canonical_accum_weight, saved * 100, zsaved * 100, path.c_str(), dots);
+    rank += 1;
+  }
+  fprintf(out, "\n");
+}
+
+// Returns the blob with anything that isn't printable escaped.
+static std::string escape_blob(const std::string &blob) {
+  std::string result;
+  for (char c : blob) {
+    if (c == '"' || c == '\\') {
+      result.push_back('\\');
+      result.push_back(c);
+    } else if (isprint(static_cast<unsigned char>(c))) {
+      result.push_back(c);
+    } else {
+      char buf[8];
+      sprintf(buf, "\\x%02x", static_cast<unsigned char>(c));
+      result += buf;
+    }
+  }
+  return result;
+}
+
+void Profiler::dump_blobs(uint32_t limit, FILE *out) {
+  std::vector<Trace*> traces;
+  for (auto entry : pool_.traces_) {
+    if (entry.second->blob_sketch() != NULL)
+      traces.push_back(entry.second);
+  }
+  std::sort(traces.begin(), traces.end(), [](const Trace *a, const Trace *b) {
+    return a->blob_sketch()->interning_savings() > b->blob_sketch()->interning_savings();
+  });
+  uint32_t rank = 1;
+  fprintf(out, "rank #trc    count    bytes distinct    saved path\n");
+  for (Trace *trace : traces) {
+    if (rank > limit)
+      break;
+    const BlobSketch &blobs = *trace->blob_sketch();
+    char bytes[32];
+    format_bytes(blobs.bytes(), bytes, 32);
+    char saved[32];
+    format_bytes(blobs.interning_savings(), saved, 32);
+    std::stringstream buf;
+    buf << *trace;
+    fprintf(out, "%4i %4i %8llu %8s %8.0f %8s %s\n", rank, trace->serial(),
+        static_cast<unsigned long long>(blobs.count()), bytes, blobs.distinct(),
+        saved, buf.str().c_str());
+    for (const BlobSketch::Blob &blob : blobs.top()) {
+      if (blob.count <= 1)
+        break;
+      const char *dots = (blob.size > BlobSketch::kSampleSize) ? "..." : "";
+      fprintf(out, "          %8llux %6iB \"%s\"%s\n",
+          static_cast<unsigned long long>(blob.count), blob.size,
+          escape_blob(blob.sample).c_str(), dots);
+    }
+    rank += 1;
+  }
+  fprintf(out, "\n");
+}
+
+void Profiler::compress_columns(int level, uint32_t thread_count) {
+  RunStats::Timer timer(run_stats_, RunStats::Stage::COLUMNS);
+  std::vector<Trace*> traces;
+  for (auto entry : pool_.traces_) {
+    if (!entry.second->column().empty())
+      traces.push_back(entry.second);
+  }
+  // Big columns first so one doesn't end up holding up everything at the end.
+  std::sort(traces.begin(), traces.end(), [](Trace *a, Trace *b) {
+    return a->column().size() > b->column().size();
+  });
+  std::atomic<uint32_t> next(0);
+  auto compress = [&]() {
+    std::vector<Bytef> buffer;
+    for (uint32_t i = next++; i < traces.size(); i = next++) {
+      std::string &column = traces[i]->column();
+      uLongf size = compressBound(column.size());
+      buffer.resize(size);
+      if (compress2(buffer.data(), &size, reinterpret_cast<const Bytef*>(column.data()),
+          column.size(), level) != Z_OK)
+        size = column.size();
+      traces[i]->set_column_compressed_size(size);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < thread_count; i++)
+    threads.emplace_back(compress);
+  compress();
+  for (std::thread &thread : threads)
+    thread.join();
+}
+
+void Profiler::dump_columns(uint32_t limit, FILE *out) {
+  std::vector<Trace*> traces;
+  for (auto entry : pool_.traces_) {
+    if (!entry.second->column().empty())
+      traces.push_back(entry.second);
+  }
+  // The traces that would gain the most from being stored in a column first.
+  auto gain = [](const Trace *trace) {
+    return trace->stats().self_data_weight() - trace->column_compressed_size();
+  };
+  std::sort(traces.begin(), traces.end(), [&](const Trace *a, const Trace *b) {
+    return gain(a) > gain(b);
+  });
+  uint32_t rank = 1;
+  fprintf(out, "rank #trc    zdata   column  zcolumn   gain%% path\n");
+  for (Trace *trace : traces) {
+    if (rank > limit)
+      break;
+    Stats &stats = trace->stats();
+    char data_weight[32];
+    format_weight(stats.self_data_weight(), data_weight, 32);
+    char column_bytes[32];
+    format_bytes(trace->column().size(), column_bytes, 32);
+    char column_weight[32];
+    format_weight(trace->column_compressed_size(), column_weight, 32);
+    std::stringstream buf;
+    buf << *trace;
+    std::string path = buf.str();
+    const char *dots = (path.size() > 32) ? "..." : "";
+    fprintf(out, "%4i %4i %8s %8s %8s %7.1f%% %.32s%s\n", rank, trace->serial(),
+        data_weight, column_bytes, column_weight,
+        Stats::safediv(gain(trace), stats.self_data_weight()) * 100, path.c_str(), dots);
+    rank += 1;
+  }
+  fprintf(out, "\n");
+}
+
+void Profiler::dump_types(uint32_t limit, FILE *out) {
+  if (!rollup_)
+    return;
+  fprintf(out, "rank    count     self    accum    zself   zaccum  zaccum%% type\n");
+  double total_weight = root().stats().accum_weight();
+  uint32_t rank = 1;
+  for (const TypeRollup::Entry *entry : rollup_->types()) {
+    if (rank > limit)
+      break;
+    const Stats &stats = entry->stats;
+    char self_bytes[32];
+    format_bytes(stats.self_bytes(), self_bytes, 32);
+    char accum_bytes[32];
+    format_bytes(stats.accum_bytes(), accum_bytes, 32);
+    char self_weight[32];
+    format_weight(stats.self_weight(), self_weight, 32);
+    char accum_weight[32];
+    format_weight(stats.accum_weight(), accum_weight, 32);
+    fprintf(out, "%4i %8" PRIu64 " %8s %8s %8s %8s %7.1f%% %s\n", rank, entry->count,
+        self_bytes, accum_bytes, self_weight, accum_weight,
+        Stats::safediv(stats.accum_weight(), total_weight) * 100, entry->name().c_str());
+    rank += 1;
+  }
+  fprintf(out, "\n");
+
+  fprintf(out, "rank     self    accum    zself   zaccum  zaccum%% field\n");
+  rank = 1;
+  for (const TypeRollup::Entry *entry : rollup_->fields()) {
+    if (rank > limit)
+      break;
+    const Stats &stats = entry->stats;
+    char self_bytes[32];
+    format_bytes(stats.self_bytes(), self_bytes, 32);
+    char accum_bytes[32];
+    format_bytes(stats.accum_bytes(), accum_bytes, 32);
+    char self_weight[32];
+    format_weight(stats.self_weight(), self_weight, 32);
+    char accum_weight[32];
+    format_weight(stats.accum_weight(), accum_weight, 32);
+    fprintf(out, "%4i %8s %8s %8s %8s %7.1f%% %s\n", rank, self_bytes, accum_bytes,
+        self_weight, accum_weight, Stats::safediv(stats.accum_weight(), total_weight) * 100,
+        entry->name().c_str());
+    rank += 1;
+  }
+  fprintf(out, "\n");
+}
+
+void Profiler::dump_sims(Trace::Order order, bool reverse, uint32_t limit, FILE *out) {
+  std::vector<Trace*> traces;
+  pool_.flush(order, reverse, &traces);
+  fprintf(out, "rank #trc    accum    deflate");
+  for (const LzConfig &config : lz_configs_)
+    fprintf(out, " %10.10s", config.name.c_str());
+  fprintf(out, " path\n");
+  uint32_t rank = 1;
+  for (Trace *trace : traces) {
+    if (rank > limit)
+      break;
+    const Stats &stats = trace->stats();
+    char accum_bytes[32];
+    format_bytes(stats.accum_bytes(), accum_bytes, 32);
+    char weight[32];
+    format_weight(stats.accum_weight(), weight, 32);
+    fprintf(out, "%4i %4i %8s %10s", rank, trace->serial(), accum_bytes, weight);
+    for (uint32_t i = 0; i < lz_configs_.size(); i++) {
+      format_weight(stats.sim_weight(i), weight, 32);
+      fprintf(out, " %10s", weight);
+    }
+    std::stringstream buf;
+    buf << *trace;
+    std::string path = buf.str();
+    const char *dots = (path.size() > 32) ? "..." : "";
+    fprintf(out, " %.32s%s\n", path.c_str(), dots);
+    rank += 1;
+  }
+  fprintf(out, "\n");
+}
+
+void Profiler::dump_slots(uint32_t limit, FILE *out) {
+  struct Occupancy {
+    std::string type;
+    uint64_t slots_set;
+    uint64_t slots_null;
+  };
+  std::unordered_map<std::string, Occupancy> by_type;
+  std::vector<Trace*> traces;
+  for (auto entry : pool_.traces_) {
+    Trace *trace = entry.second;
+    const Stats &stats = trace->stats();
+    if (stats.slots_set() + stats.slots_null() == 0)
+      continue;
+    traces.push_back(trace);
+    const TraceLink &link = trace->path()[0];
+    if (link.type() != TraceLink::Type::STRUCT_FIELD)
+      continue;
+    std::string type = link.as_struct_field()->getContainingStruct().getShortDisplayName().cStr();
+    Occupancy &occupancy = by_type[type];
+    occupancy.type = type;
+    occupancy.slots_set += stats.slots_set();
+    occupancy.slots_null += stats.slots_null();
+  }
+
+  std::vector<const Occupancy*> types;
+  for (auto &entry : by_type)
+    types.push_back(&entry.second);
+  std::sort(types.begin(), types.end(), [](const Occupancy *a, const Occupancy *b) {
+    return a->slots_null > b->slots_null;
+  });
+  fprintf(out, "    slots      set   nullB    set%% type\n");
+  for (const Occupancy *occupancy : types) {
+    char null_bytes[32];
+    format_bytes(occupancy->slots_null * 8, null_bytes, 32);
+    uint64_t slots = occupancy->slots_set + occupancy->slots_null;
+    fprintf(out, "%9" PRIu64 " %8" PRIu64 " %7s %6.1f%% %s\n", slots, occupancy->slots_set,
+        null_bytes, Stats::safediv(occupancy->slots_set, slots) * 100, occupancy->type.c_str());
+  }
+  fprintf(out, "\n");
+
+  std::sort(traces.begin(), traces.end(), [](const Trace *a, const Trace *b) {
+    return a->stats().null_slot_bytes() > b->stats().null_slot_bytes();
+  });
+  uint32_t rank = 1;
+  fprintf(out, "rank #trc      set     null   nullB    set%% path\n");
+  for (Trace *trace : traces) {
+    if (rank > limit)
+      break;
+    const Stats &stats = trace->stats();
+    char null_bytes[32];
+    format_bytes(stats.null_slot_bytes(), null_bytes, 32);
+    std::stringstream buf;
+    buf << *trace;
+    std::string path = buf.str();
+    const char *dots = (path.size() > 32) ? "..." : "";
+    fprintf(out, "%4i %4i %8i %8i %7s %6.1f%% %.32s%s\n", rank, trace->serial(),
+        stats.slots_set(), stats.slots_null(), null_bytes, stats.slot_occupancy() * 100,
+        path.c_str(), dots);
+    rank += 1;
   }
+  fprintf(out, "\n");
 }
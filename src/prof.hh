@@ -1,55 +1,339 @@
 #pragma once
 
+#include "cache.hh"
 #include "trace.hh"
 #include "heatmap.hh"
+#include "lz.hh"
+#include "pointer.hh"
+#include "runstats.hh"
+#include "state.hh"
 
+#include <capnp/schema-loader.h>
 #include <capnp/schema-parser.h>
 #include <kj/filesystem.h>
 #include <kj/memory.h>
+#include <cstdio>
+#include <functional>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace capnprof {
 
+class StaticContext;
+typedef void (*StaticProfileFunction)(StaticContext &context, TracePath &path,
+    capnp::AnyStruct::Reader reader);
+
 class InputMap {
 public:
   InputMap(HeatMap &heat_map, kj::ArrayPtr<const capnp::word> data);
   ~InputMap();
   double weigh(const void *start, uint32_t size_bytes);
+  // Weighs a range of bits, each bit weighing an eighth of its byte.
+  double weigh_bits(const void *start, uint32_t bit_offset, uint32_t bit_count);
+
+  // Adds a heat map to weigh the same bytes with on the side, for comparing
+  // codecs in a single pass.
+  static const uint32_t kMaxSims = 8;
+  void add_sim(std::unique_ptr<HeatMap> heat_map);
+  // Weighs a range of bits with each of the side heat maps and returns how
+  // many weights were written to out.
+  uint32_t weigh_sims(const void *start, uint32_t bit_offset, uint32_t bit_count, double *out);
 
 private:
   HeatMap &heat_map_;
+  std::vector<std::unique_ptr<HeatMap>> sims_;
   kj::ArrayPtr<uint8_t> counts_;
   kj::ArrayPtr<const capnp::word> data_;
 };
 
+// Tells the profiler which struct type to read an AnyPointer field as. If a
+// discriminant is given the mapping only applies to structs where the sibling
+// field of that name has the given value.
+struct TypeMapping {
+  std::string struct_name;
+  std::string field_name;
+  std::string discriminant;
+  std::string value;
+  std::string type;
+};
+
+// Selects the root struct type for archive entries whose names match a glob
+// pattern. Entries that match a rule with no type are skipped.
+struct EntryRule {
+  std::string pattern;
+  std::string type;
+};
+
+// What a single archive entry contributed to the profile. The checksum and
+// header offset are what identify the entry in a saved state, together with
+// the archive and entry names.
+struct EntrySummary {
+  std::string archive;
+  std::string name;
+  std::string type;
+  uint32_t crc;
+  uint64_t header_offset;
+  uint64_t raw_bytes;
+  uint64_t compressed_bytes;
+  double weight;
+};
+
+// An archive entry that has been inflated and weighed, ready to be
+// traversed.
+struct PreparedEntry {
+  PreparedEntry() : deflate_profile(NULL) { }
+  EntrySummary summary;
+  std::string key;
+  CachedProfile profile;
+  // Set instead of profile's contents and weights when zipprof weighed the
+  // entry and the sink doesn't keep it, valid only until the sink returns.
+  zipprof::DeflateProfile *deflate_profile;
+  std::vector<std::unique_ptr<HeatMap>> sims;
+};
+
+typedef std::function<void(std::unique_ptr<PreparedEntry> entry)> PreparedEntrySink;
+
 class Profiler {
 public:
   Profiler();
   Profiler &add_include_path(std::string path);
+  Profiler &add_type_mapping(TypeMapping mapping);
+
+  // Rules are tried in the order they were added and the first that matches
+  // an entry decides its type. Entries no rule matches use the type passed to
+  // profile_archive.
+  Profiler &add_entry_rule(EntryRule rule);
   Profiler &parse_schema(std::string path);
+
+  // Loads the schema nodes from a serialized CodeGeneratorRequest, as
+  // produced by capnp compile -o-, instead of parsing the schema text.
+  Profiler &load_schema(std::string path);
+  Profiler &load_schema(kj::ArrayPtr<const capnp::word> data);
   Profiler &set_heat_map(HeatMap &value);
+
+  // Profiles structs with the given id with a function generated by
+  // capnpc-cprof instead of the dynamic API. Generated profilers are
+  // bypassed when the data section is split or slot stats are kept.
+  Profiler &add_static_profiler(uint64_t struct_id, StaticProfileFunction function);
+
+  // Chooses how the compressed size of archive entries is charged to their
+  // bytes. Only profile_archive uses the policy; messages profiled on their
+  // own use the heat map.
+  Profiler &set_heat_policy(HeatPolicy value);
+
+  // Keeps the inflated contents and deflate profile of archive entries in
+  // the given directory and reuses them when the same entry is profiled
+  // again. An empty directory disables the cache.
+  Profiler &set_cache_dir(std::string dir);
   void dump(Trace::Order order = Trace::Order::SELF_BYTES,
-      bool reverse = false, uint32_t limit = 0, uint32_t cutoff_bytes = 0);
+      bool reverse = false, uint32_t limit = 0, uint32_t cutoff_bytes = 0,
+      FILE *out = stdout);
+
+  // Prints the entries profiled so far, most expensive first.
+  void dump_entries(uint32_t limit = 0, FILE *out = stdout);
+  const std::vector<EntrySummary> &entries() { return entries_; }
 
   void profile(std::string struct_name, kj::ArrayPtr<const capnp::word> data);
-  void profile_archive(std::string struct_name, kj::ArrayPtr<const uint8_t> data);
+  void profile(capnp::StructSchema schema, kj::ArrayPtr<const capnp::word> data);
+  void profile_archive(std::string struct_name, kj::ArrayPtr<const uint8_t> data,
+      std::string archive_name = "");
+
+  // The two halves of profile_archive. Preparing inflates and weighs every
+  // entry that the entry rules don't skip and whose key isn't known, and
+  // hands it to the sink. It only reads the profiler's settings, so archives
+  // can be prepared on other threads, each with their own run stats, while
+  // one thread profiles the prepared entries in order. A sink that keeps
+  // entries past its return must say so, so zipprof's weights get copied.
+  void prepare_archive(std::string struct_name, kj::ArrayPtr<const uint8_t> data,
+      std::string archive_name, const std::unordered_set<std::string> &known_keys,
+      RunStats &run_stats, bool keeps_entries, PreparedEntrySink sink);
+  void profile_prepared(PreparedEntry &entry);
+  // The keys of the archive entries profiled so far or loaded from a state.
+  const std::unordered_set<std::string> &entry_keys() const { return entry_keys_; }
   capnp::ParsedSchema &parsed_schema() { return parsed_schema_; }
+
+  // Returns the struct with the given name from the loaded or, if it isn't
+  // there, the parsed schema.
+  capnp::StructSchema find_struct(std::string name);
   Profiler &set_trace_depth(uint32_t value);
 
+  // Switches to adaptive depth. The traces collected so far whose accumulated
+  // weight is at least the given fraction of the total are considered hot and
+  // from then on paths that end in a hot trace are traced to the given depth
+  // rather than the normal trace depth. The collected traces are discarded so
+  // the input can be profiled again.
+  Profiler &refine(uint32_t depth, double threshold);
+
+  // Folds recursive paths back onto their first occurrence so the number of
+  // traces doesn't depend on how deeply a recursive type is nested. The cost
+  // at each level of recursion is recorded in the traces' level bytes.
+  Profiler &set_fold_recursion(bool value);
+
+  // Only descends into the fields on the given path from the root, such as
+  // Envelope.payload.items, and everything under its last field. Components
+  // are glob patterns matched against the root struct's name and then field
+  // names; list elements don't need a component. Fields that lead elsewhere
+  // are skipped without being read, so only the structs along the way and
+  // the subtree are traced. The size of what skipped pointers lead to is
+  // taken from the pointers and charged to an (out of scope) trace under the
+  // struct, without weight. In split data mode the slots of skipped groups
+  // count as padding.
+  Profiler &set_scope(std::string value);
+
+  // The size of the messages profiled so far, segment tables included.
+  uint64_t message_bytes() const { return message_bytes_; }
+
+  // The bytes left out of the traces by the scope so far.
+  uint64_t out_of_scope_bytes() const { return out_of_scope_bytes_; }
+
+  // Caps the number of traces kept between messages, see TracePool::trim.
+  Profiler &set_max_traces(uint32_t value);
+
+  // Also profiles the canonical encoding of every message into a separate
+  // pool so the two can be compared with dump_canonical. Both encodings are
+  // weighed the same way, each message zipped on its own with zlib, so the
+  // original is profiled once more like that into a pool of its own.
+  Profiler &set_canonical_what_if(bool value);
+  void canonical_traces(Trace::Order order, bool reverse, std::vector<Trace*> *traces_out);
+  void zipped_traces(Trace::Order order, bool reverse, std::vector<Trace*> *traces_out);
+
+  // Sketches the Text and Data blobs under each trace to estimate how much
+  // could be saved by interning them, see dump_blobs.
+  Profiler &set_sketch_blobs(bool value);
+
+  // Prints the traces with the most to gain from interning their blobs, with
+  // their most frequent blobs.
+  void dump_blobs(uint32_t limit = 0, FILE *out = stdout);
+
+  // Gathers the data bytes of each trace into a buffer of its own so they can
+  // be compressed in isolation, as if stored in a column, by
+  // compress_columns.
+  Profiler &set_gather_columns(bool value);
+
+  // Compresses each trace's gathered bytes on their own with zlib at the
+  // given level, spread over the given number of threads.
+  void compress_columns(int level, uint32_t thread_count);
+
+  // Prints each trace's zipped data cost within the message next to the size
+  // of its data when compressed on its own.
+  void dump_columns(uint32_t limit = 0, FILE *out = stdout);
+
+  // Charges each primitive field's slot in the data section to a trace of its
+  // own instead of charging the whole section to the struct. Bits no field
+  // uses are charged to a (padding) trace under the struct.
+  Profiler &set_split_data(bool value);
+
+  // Counts how often each pointer field is set or null, including fields
+  // whose slot is null, which otherwise don't get a trace.
+  Profiler &set_slot_stats(bool value);
+
+  // Prints the pointer slot occupancy of each struct type, then the fields
+  // whose null slots waste the most bytes.
+  void dump_slots(uint32_t limit = 0, FILE *out = stdout);
+
+  // Rolls up the bytes of every trace by struct type and field as messages
+  // are profiled, see dump_types.
+  Profiler &set_type_rollup(bool value);
+
+  // Prints the struct types with the most accumulated bytes, then the fields.
+  void dump_types(uint32_t limit = 0, FILE *out = stdout);
+  const TypeRollup *type_rollup() const { return rollup_.get(); }
+
+  // Also weighs every message with the LZ77 simulator configured as given,
+  // alongside the deflate weights, see dump_sims.
+  Profiler &add_lz_config(const LzConfig &config);
+  const std::vector<LzConfig> &lz_configs() const { return lz_configs_; }
+
+  // Prints each trace's accumulated weight under deflate and under each
+  // simulated codec side by side.
+  void dump_sims(Trace::Order order = Trace::Order::ACCUM_BYTES, bool reverse = false,
+      uint32_t limit = 0, FILE *out = stdout);
+
+  // Prints the original and canonical cost of each trace side by side.
+  void dump_canonical(Trace::Order order = Trace::Order::ACCUM_BYTES,
+      bool reverse = false, uint32_t limit = 0, FILE *out = stdout);
+
   void traces(Trace::Order order, bool reverse, std::vector<Trace*> *traces_out);
   Trace &root();
 
+  // Time spent in each stage of profiling and counts of the work done, with
+  // the counters of the trace pool brought up to date.
+  RunStats &run_stats();
+
+  // Adds the traces collected by the given profiler to this one.
+  void merge(Profiler &that);
+
+  // Discards all the traces, entries and run stats collected so far.
+  void clear();
+
+  // Saves the traces and the entries profiled so far so a later run can load
+  // them and profile only the archive entries added since. Blob sketches,
+  // gathered columns, canonical traces, the type rollup and simulated codec
+  // weights aren't saved.
+  bool save_state(std::string path);
+
+  // Adds the traces and entries of a saved state to this profiler. Archive
+  // entries in the state are skipped by profile_archive from then on. Fails
+  // if the state can't be read, was saved with different trace settings or
+  // refers to structs that aren't in the schema.
+  bool load_state(std::string path);
+
 private:
-  void profile_with_context(std::string struct_name,
+  friend class StaticContext;
+
+  void configure(TraceContext &context);
+  // Inflates an entry and weighs its bytes with the heat policy. Returns
+  // false if the entry can't be inflated, in which case zipprof's literal
+  // weights are used instead.
+  bool inflate_entry(const ArchiveIndex &index, const ArchiveEntry &entry, CachedProfile *out);
+  // Profiles an entry's contents and returns the weight it added.
+  double profile_entry(capnp::StructSchema schema, kj::ArrayPtr<const capnp::word> words,
+      HeatMap &heat_map, std::vector<std::unique_ptr<HeatMap>> sims);
+  // Builds a heat map for each simulated codec.
+  std::vector<std::unique_ptr<HeatMap>> simulate(kj::ArrayPtr<const capnp::word> words,
+      RunStats &run_stats);
+  void profile_with_context(capnp::StructSchema schema,
       kj::ArrayPtr<const capnp::word> data, TraceContext &context);
+  void profile_root(capnp::DynamicStruct::Reader reader, TraceContext &context);
+  void profile_canonical(capnp::DynamicStruct::Reader reader,
+      kj::ArrayPtr<const capnp::word> data);
+  void profile_zipped(capnp::DynamicStruct::Reader reader, kj::ArrayPtr<const capnp::word> data,
+      TracePool &pool);
 
   void profile_struct(TracePath &path, capnp::DynamicStruct::Reader reader);
+  void profile_dynamic_struct(TracePath &path, capnp::DynamicStruct::Reader reader);
+  // Profiles the fields of a struct or group. If used isn't NULL the data
+  // section is split between the fields and the bits they use are marked.
+  void profile_fields(TracePath &path, capnp::DynamicStruct::Reader reader,
+      kj::ArrayPtr<const kj::byte> data_section, kj::ArrayPtr<const capnp::word> pointers,
+      std::vector<bool> *used);
+  void profile_slot(TracePath &path, kj::ArrayPtr<const kj::byte> data_section,
+      uint32_t bit_offset, uint32_t bit_count, std::vector<bool> *used);
   void profile_value(TracePath &path, capnp::DynamicValue::Reader reader);
+  void profile_any_pointer(TracePath &path, capnp::DynamicStruct::Reader parent,
+      capnp::StructSchema::Field field, capnp::AnyPointer::Reader reader);
   void profile_list(TracePath &path, capnp::DynamicList::Reader reader);
   void profile_text(TracePath &path, capnp::Text::Reader reader);
   void profile_data(TracePath &path, capnp::Data::Reader reader);
 
+  // The bytes of a list that aren't its elements' own: the pointer array of
+  // a pointer list or the tag word of an inline composite list.
+  static kj::ArrayPtr<const kj::byte> list_overhead(capnp::AnyList::Reader reader);
+  static std::string value_repr(capnp::DynamicValue::Reader value);
+  static ReadCost pointer_read_cost(const RawPointer &pointer, bool is_list);
+
+  // Adds the given struct and every struct reachable through its fields to
+  // structs_by_id_, for generated profilers to look up.
+  void index_structs(capnp::StructSchema schema);
+  // Indexes every struct in the loaded and parsed schemas.
+  void index_all_structs();
+  void index_parsed(capnp::ParsedSchema schema);
+  bool read_link(StateReader &in, TraceLink *out);
+  capnp::StructSchema struct_by_id(uint64_t id);
+
   static void format_quantity(double bytes, char *buf, uint32_t bufsize, const char **suffixes);
   static void format_bytes(uint32_t bytes, char *buf, uint32_t bufsize);
   static void format_weight(double value, char *buf, uint32_t bufsize);
@@ -58,9 +342,39 @@ private:
   kj::Own<kj::Filesystem> fs_;
   capnp::SchemaParser schema_parser_;
   capnp::ParsedSchema parsed_schema_;
+  capnp::SchemaLoader schema_loader_;
+  std::unordered_map<std::string, uint64_t> loaded_structs_;
   std::vector<std::string> include_paths_;
+  std::vector<TypeMapping> type_mappings_;
+  std::vector<EntryRule> entry_rules_;
+  std::vector<LzConfig> lz_configs_;
+  std::string scope_spec_;
+  std::vector<std::string> scope_;
+  std::vector<EntrySummary> entries_;
+  std::unordered_set<std::string> entry_keys_;
+  std::unordered_set<std::string> link_names_;
   uint32_t trace_depth_;
+  uint32_t refine_depth_;
+  // Copies of the traces found hot by refine, without their stats.
+  TracePool hot_traces_;
+  bool fold_recursion_;
+  bool sketch_blobs_;
+  bool gather_columns_;
+  bool split_data_;
+  bool slot_stats_;
+  uint32_t max_traces_;
   HeatMap *heat_map_;
+  HeatPolicy heat_policy_;
+  std::unique_ptr<TracePool> canonical_pool_;
+  std::unique_ptr<TracePool> zipped_pool_;
+  std::unique_ptr<TypeRollup> rollup_;
+  std::unique_ptr<ProfileCache> cache_;
+  std::unordered_map<uint64_t, StaticProfileFunction> static_profilers_;
+  std::unordered_map<uint64_t, capnp::StructSchema> structs_by_id_;
+  uint64_t message_bytes_;
+  uint64_t canonical_message_bytes_;
+  uint64_t out_of_scope_bytes_;
+  RunStats run_stats_;
 };
 
 } // namespace capnprof
@@ -0,0 +1,64 @@
+#include "rollup.hh"
+
+#include <algorithm>
+
+using namespace capnprof;
+
+std::string TypeRollup::Entry::name() const {
+  std::string result = type.getShortDisplayName().cStr();
+  if (field >= 0)
+    result = result + "." + type.getFields()[field].getProto().getName().cStr();
+  return result;
+}
+
+TypeRollup::Entry &TypeRollup::get_or_create(capnp::StructSchema schema, int32_t field) {
+  auto key = std::make_pair(schema.getProto().getId(), field);
+  auto iter = entries_.find(key);
+  if (iter == entries_.end()) {
+    Entry entry;
+    entry.type = schema;
+    entry.field = field;
+    entry.count = 0;
+    entry.is_seen = false;
+    iter = entries_.emplace(key, entry).first;
+  }
+  return iter->second;
+}
+
+TypeRollup::Entry &TypeRollup::type(capnp::StructSchema schema) {
+  return get_or_create(schema, -1);
+}
+
+TypeRollup::Entry &TypeRollup::field(const capnp::StructSchema::Field &field) {
+  return get_or_create(field.getContainingStruct(), field.getIndex());
+}
+
+void TypeRollup::merge(const TypeRollup &that) {
+  for (auto &entry : that.entries_) {
+    Entry &mine = get_or_create(entry.second.type, entry.second.field);
+    mine.count += entry.second.count;
+    mine.stats += entry.second.stats;
+  }
+}
+
+static std::vector<const TypeRollup::Entry*> sorted(
+    const std::map<std::pair<uint64_t, int32_t>, TypeRollup::Entry> &entries, bool fields) {
+  std::vector<const TypeRollup::Entry*> result;
+  for (auto &entry : entries) {
+    if ((entry.second.field >= 0) == fields)
+      result.push_back(&entry.second);
+  }
+  std::sort(result.begin(), result.end(),
+      [](const TypeRollup::Entry *a, const TypeRollup::Entry *b) {
+    return a->stats.accum_bytes() > b->stats.accum_bytes();
+  });
+  return result;
+}
+
+std::vector<const TypeRollup::Entry*> TypeRollup::types() const {
+  return sorted(entries_, false);
+}
+
+std::vector<const TypeRollup::Entry*> TypeRollup::fields() const {
+  return sorted(entries_, true);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "stats.hh"
+
+#include <capnp/schema.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace capnprof {
+
+// Stats rolled up by struct type and by field, whatever path they were found
+// on, so the total cost of a type isn't split between the traces of all the
+// places it is used. A type's self bytes are the sections of its instances and
+// its child bytes everything they point to; a field's self bytes are what it
+// points to directly. Recursive types count each byte once.
+class TypeRollup {
+public:
+  struct Entry {
+    capnp::StructSchema type;
+    // The index of the field within the type, or -1 for the type itself.
+    int32_t field;
+    // The number of instances of the type. Fields aren't counted.
+    uint64_t count;
+    Stats stats;
+    bool is_seen;
+
+    std::string name() const;
+  };
+
+  Entry &type(capnp::StructSchema schema);
+  Entry &field(const capnp::StructSchema::Field &field);
+
+  // Adds the entries of the given rollup to this one.
+  void merge(const TypeRollup &that);
+  void clear() { entries_.clear(); }
+
+  // The entries for types or for fields, most accumulated bytes first.
+  std::vector<const Entry*> types() const;
+  std::vector<const Entry*> fields() const;
+
+private:
+  Entry &get_or_create(capnp::StructSchema schema, int32_t field);
+
+  std::map<std::pair<uint64_t, int32_t>, Entry> entries_;
+};
+
+} // namespace capnprof
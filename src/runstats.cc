@@ -0,0 +1,109 @@
+#include "runstats.hh"
+
+#include "stats.hh"
+
+#include <cinttypes>
+
+using namespace capnprof;
+
+RunStats::Timer::Timer(RunStats &stats, Stage stage)
+    : stats_(stats)
+    , stage_(stage)
+    , running_(true)
+    , start_(std::chrono::steady_clock::now()) { }
+
+void RunStats::Timer::stop() {
+  if (!running_)
+    return;
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+  stats_.add_time(stage_, elapsed.count());
+  running_ = false;
+}
+
+RunStats::RunStats()
+    : start_(std::chrono::steady_clock::now())
+    , seconds_()
+    , messages_(0)
+    , entries_(0)
+    , skipped_entries_(0)
+    , message_words_(0)
+    , pool_() { }
+
+void RunStats::add_time(Stage stage, double seconds) {
+  seconds_[static_cast<int>(stage)] += seconds;
+}
+
+double RunStats::total_seconds() const {
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+  return elapsed.count();
+}
+
+void RunStats::add_message(uint64_t words) {
+  messages_ += 1;
+  message_words_ += words;
+}
+
+void RunStats::merge(const RunStats &that) {
+  for (int i = 0; i < static_cast<int>(Stage::COUNT); i++)
+    seconds_[i] += that.seconds_[i];
+  messages_ += that.messages_;
+  entries_ += that.entries_;
+  skipped_entries_ += that.skipped_entries_;
+  message_words_ += that.message_words_;
+}
+
+const char *RunStats::stage_name(Stage stage) {
+  switch (stage) {
+  case Stage::SCHEMA:
+    return "schema";
+  case Stage::READ:
+    return "read";
+  case Stage::INFLATE:
+    return "inflate";
+  case Stage::SIMULATE:
+    return "simulate";
+  case Stage::TRAVERSE:
+    return "traverse";
+  case Stage::CANONICAL:
+    return "canonical";
+  case Stage::COLUMNS:
+    return "columns";
+  case Stage::OUTPUT:
+    return "output";
+  default:
+    return "unknown";
+  }
+}
+
+void RunStats::print(FILE *out) const {
+  double total = total_seconds();
+  fprintf(out, "stage        seconds      %%\n");
+  for (int i = 0; i < static_cast<int>(Stage::COUNT); i++) {
+    fprintf(out, "%-10s %9.3f %5.1f%%\n", stage_name(static_cast<Stage>(i)), seconds_[i],
+        Stats::safediv(seconds_[i], total) * 100);
+  }
+  fprintf(out, "%-10s %9.3f\n", "total", total);
+  fprintf(out, "messages %" PRIu64 ", entries %" PRIu64 ", skipped %" PRIu64
+      ", message words %" PRIu64 "\n", messages_, entries_, skipped_entries_, message_words_);
+  fprintf(out, "traces created %" PRIu64 ", pool lookups %" PRIu64 ", hits %" PRIu64 " (%.1f%%)\n",
+      pool_.created, pool_.lookups, pool_.hits,
+      Stats::safediv(pool_.hits, pool_.lookups) * 100);
+  fprintf(out, "peak traces %" PRIu64 ", peak pool memory %" PRIu64 " bytes\n",
+      pool_.peak_traces, pool_.peak_bytes);
+}
+
+void RunStats::write_json(std::ostream &out) const {
+  out << "{\"seconds\": {";
+  for (int i = 0; i < static_cast<int>(Stage::COUNT); i++)
+    out << "\"" << stage_name(static_cast<Stage>(i)) << "\": " << seconds_[i] << ", ";
+  out << "\"total\": " << total_seconds() << "}, ";
+  out << "\"messages\": " << messages_ << ", ";
+  out << "\"entries\": " << entries_ << ", ";
+  out << "\"skipped_entries\": " << skipped_entries_ << ", ";
+  out << "\"message_words\": " << message_words_ << ", ";
+  out << "\"traces_created\": " << pool_.created << ", ";
+  out << "\"pool_lookups\": " << pool_.lookups << ", ";
+  out << "\"pool_hits\": " << pool_.hits << ", ";
+  out << "\"peak_traces\": " << pool_.peak_traces << ", ";
+  out << "\"peak_pool_bytes\": " << pool_.peak_bytes << "}" << std::endl;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+
+namespace capnprof {
+
+// Where a profiling run spends its time and how much work it did, so slow
+// runs can be diagnosed and jobs sized.
+class RunStats {
+public:
+  enum class Stage {
+    SCHEMA,     // Parsing or loading the schema.
+    READ,       // Reading the input files.
+    INFLATE,    // Decompressing and deflate profiling archive entries.
+    SIMULATE,   // Compressing messages with the simulated codecs.
+    TRAVERSE,   // Walking messages and accumulating traces.
+    CANONICAL,  // Canonicalizing and compressing messages for the what-if.
+    COLUMNS,    // Compressing the gathered columns.
+    OUTPUT,     // Sorting and printing the reports.
+    COUNT
+  };
+
+  // Adds the time from its construction to its destruction, or until it is
+  // stopped, to a stage.
+  class Timer {
+  public:
+    Timer(RunStats &stats, Stage stage);
+    ~Timer() { stop(); }
+    void stop();
+
+  private:
+    RunStats &stats_;
+    Stage stage_;
+    bool running_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  // The counters kept by a trace pool, copied in before the stats are
+  // printed.
+  struct PoolCounters {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t created;
+    uint64_t peak_traces;
+    uint64_t peak_bytes;
+  };
+
+  RunStats();
+  void add_time(Stage stage, double seconds);
+  double seconds(Stage stage) const { return seconds_[static_cast<int>(stage)]; }
+  double total_seconds() const;
+
+  // Counts a message and its size in words, whether or not it was walked in
+  // full, see Profiler::set_scope.
+  void add_message(uint64_t words);
+  void add_entry() { entries_ += 1; }
+  // Counts an entry that wasn't profiled because a loaded state has it.
+  void add_skipped_entry() { skipped_entries_ += 1; }
+  uint64_t messages() const { return messages_; }
+  uint64_t entries() const { return entries_; }
+  uint64_t skipped_entries() const { return skipped_entries_; }
+  uint64_t message_words() const { return message_words_; }
+
+  void set_pool_counters(const PoolCounters &value) { pool_ = value; }
+  const PoolCounters &pool_counters() const { return pool_; }
+
+  // Adds the times and counters of the given stats to these.
+  void merge(const RunStats &that);
+
+  void print(FILE *out) const;
+  // Writes the stats as a single JSON object.
+  void write_json(std::ostream &out) const;
+
+  static const char *stage_name(Stage stage);
+
+private:
+  std::chrono::steady_clock::time_point start_;
+  double seconds_[static_cast<int>(Stage::COUNT)];
+  uint64_t messages_;
+  uint64_t entries_;
+  uint64_t skipped_entries_;
+  uint64_t message_words_;
+  PoolCounters pool_;
+};
+
+} // namespace capnprof
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+namespace capnprof {
+
+// Writes the fixed-size values and strings of a saved profile. Values are
+// written in host byte order, so a state can only be loaded on a host like
+// the one that saved it.
+class StateWriter {
+public:
+  explicit StateWriter(std::ostream &out) : out_(out) { }
+
+  template <typename T>
+  void write(const T &value) {
+    out_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void write_string(const std::string &value) {
+    write(static_cast<uint32_t>(value.size()));
+    out_.write(value.data(), value.size());
+  }
+
+  bool ok() const { return static_cast<bool>(out_); }
+
+private:
+  std::ostream &out_;
+};
+
+// Reads what a StateWriter wrote. Once a read fails every later read fails
+// too, so callers can check once at the end.
+class StateReader {
+public:
+  explicit StateReader(std::istream &in) : in_(in) { }
+
+  template <typename T>
+  bool read(T *value) {
+    return static_cast<bool>(in_.read(reinterpret_cast<char*>(value), sizeof(*value)));
+  }
+
+  bool read_string(std::string *value) {
+    uint32_t size;
+    if (!read(&size))
+      return false;
+    value->resize(size);
+    return static_cast<bool>(in_.read(&(*value)[0], size));
+  }
+
+  bool ok() const { return static_cast<bool>(in_); }
+
+private:
+  std::istream &in_;
+};
+
+} // namespace capnprof
@@ -0,0 +1,109 @@
+#include "static.hh"
+
+#include <capnp/dynamic.h>
+
+using namespace capnprof;
+using namespace capnp;
+using namespace kj;
+
+void StaticContext::add_sections(TracePath &path, AnyStruct::Reader reader,
+    StructSchema schema) {
+  path.set_struct(schema);
+  ArrayPtr<const byte> data_section = reader.getDataSection();
+  path.add_data(data_section);
+  path.add_pointers(ArrayPtr<const byte>(word_align(data_section.end()),
+      reader.getPointerSection().size() * sizeof(word)));
+}
+
+void StaticContext::read_primitive(TracePath &path) {
+  ReadCost cost;
+  cost.bounds_checks = 1;
+  path.add_reads(cost);
+}
+
+void StaticContext::follow_pointer(TracePath &path, AnyStruct::Reader reader, uint32_t slot,
+    bool is_list) {
+  const word *pointers = reinterpret_cast<const word*>(word_align(reader.getDataSection().end()));
+  RawPointer pointer(pointers + slot);
+  if (pointer.kind() == RawPointer::Kind::STRUCT || pointer.kind() == RawPointer::Kind::LIST)
+    path.add_pointer_distance(static_cast<int64_t>(pointer.offset()) * sizeof(word));
+  ReadCost cost;
+  cost.bounds_checks = 1;
+  cost += Profiler::pointer_read_cost(pointer, is_list);
+  path.add_reads(cost);
+}
+
+void StaticContext::profile_text(TracePath &path, Text::Reader reader) {
+  profiler_.profile_text(path, reader);
+}
+
+void StaticContext::profile_data(TracePath &path, Data::Reader reader) {
+  profiler_.profile_data(path, reader);
+}
+
+void StaticContext::read_elements(TracePath &path, uint32_t count) {
+  ReadCost cost;
+  cost.bounds_checks = count;
+  path.add_reads(cost);
+}
+
+void StaticContext::add_list_overhead(TracePath &path, AnyList::Reader reader) {
+  ArrayPtr<const byte> overhead = Profiler::list_overhead(reader);
+  if (overhead.size() > 0)
+    path.add_pointers(overhead);
+}
+
+void StaticContext::profile_primitive_list(TracePath &path, AnyList::Reader reader) {
+  if (reader.size() == 0)
+    return;
+  read_elements(path, reader.size());
+  path.add_data(reader.getRawBytes());
+}
+
+// The elements of text and data lists are pointers.
+static void read_pointer_elements(TracePath &path, uint32_t count) {
+  ReadCost cost;
+  cost.hops = count;
+  cost.bounds_checks = count;
+  cost.list_decodes = count;
+  path.add_reads(cost);
+}
+
+void StaticContext::profile_text_list(TracePath &path, List<Text>::Reader reader) {
+  if (reader.size() == 0)
+    return;
+  read_elements(path, reader.size());
+  add_list_overhead(path, reader);
+  TracePath inner(path, TraceLink::Type::ARRAY);
+  read_pointer_elements(inner, reader.size());
+  for (Text::Reader text : reader)
+    profiler_.profile_text(inner, text);
+}
+
+void StaticContext::profile_data_list(TracePath &path, List<Data>::Reader reader) {
+  if (reader.size() == 0)
+    return;
+  read_elements(path, reader.size());
+  add_list_overhead(path, reader);
+  TracePath inner(path, TraceLink::Type::ARRAY);
+  read_pointer_elements(inner, reader.size());
+  for (Data::Reader data : reader)
+    profiler_.profile_data(inner, data);
+}
+
+void StaticContext::profile_struct(TracePath &path, AnyStruct::Reader reader,
+    uint64_t struct_id) {
+  profiler_.profile_struct(path, reader.as<DynamicStruct>(schema(struct_id)));
+}
+
+void StaticContext::profile_field(TracePath &path, AnyStruct::Reader parent,
+    StructSchema schema, uint32_t field_index) {
+  DynamicStruct::Reader reader = parent.as<DynamicStruct>(schema);
+  StructSchema::Field field = schema.getFields()[field_index];
+  DynamicValue::Reader value = reader.get(field);
+  if (value.getType() == DynamicValue::ANY_POINTER) {
+    profiler_.profile_any_pointer(path, reader, field, value.as<AnyPointer>());
+  } else {
+    profiler_.profile_value(path, value);
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "prof.hh"
+
+#include <capnp/any.h>
+#include <capnp/list.h>
+
+namespace capnprof {
+
+// What profilers generated by capnpc-cprof use to charge their findings to a
+// Profiler. Each call does what the dynamic traversal does at the same point,
+// so generated and dynamic profiles have the same traces.
+class StaticContext {
+public:
+  explicit StaticContext(Profiler &profiler)
+      : profiler_(profiler) { }
+
+  capnp::StructSchema schema(uint64_t struct_id) { return profiler_.struct_by_id(struct_id); }
+
+  // Adds the data and pointer sections of a struct of the given type.
+  void add_sections(TracePath &path, capnp::AnyStruct::Reader reader,
+      capnp::StructSchema schema);
+  // Charges reading a primitive field.
+  void read_primitive(TracePath &path);
+  // Charges following the non-null pointer in the given slot of a struct.
+  void follow_pointer(TracePath &path, capnp::AnyStruct::Reader reader, uint32_t slot,
+      bool is_list);
+
+  void profile_text(TracePath &path, capnp::Text::Reader reader);
+  void profile_data(TracePath &path, capnp::Data::Reader reader);
+  void profile_primitive_list(TracePath &path, capnp::AnyList::Reader reader);
+  void profile_text_list(TracePath &path, capnp::List<capnp::Text>::Reader reader);
+  void profile_data_list(TracePath &path, capnp::List<capnp::Data>::Reader reader);
+  // Adds the pointer array or tag word of a list of pointers or structs.
+  void add_list_overhead(TracePath &path, capnp::AnyList::Reader reader);
+  // Charges the bounds checks for reading each element of a list.
+  void read_elements(TracePath &path, uint32_t count);
+
+  // Profiles a struct there is no generated profiler for.
+  void profile_struct(TracePath &path, capnp::AnyStruct::Reader reader, uint64_t struct_id);
+  // Profiles the value of a field the generator leaves to the dynamic API.
+  void profile_field(TracePath &path, capnp::AnyStruct::Reader parent,
+      capnp::StructSchema schema, uint32_t field_index);
+
+private:
+  Profiler &profiler_;
+};
+
+} // namespace capnprof
@@ -1,13 +1,168 @@
 #include "stats.hh"
 
+#include "state.hh"
+
+#include <cstdlib>
+#include <cstring>
+
 using namespace capnprof;
 
+ReadCost &ReadCost::operator+=(const ReadCost &that) {
+  hops += that.hops;
+  list_decodes += that.list_decodes;
+  far_hops += that.far_hops;
+  bounds_checks += that.bounds_checks;
+  return *this;
+}
+
+double ReadCost::score() const {
+  return hops * kHopCost + list_decodes * kListDecodeCost + far_hops * kFarHopCost
+      + bounds_checks * kBoundsCheckCost;
+}
+
 Stats::Stats()
-    : self_data_bytes_(0)
+    : self_data_bits_(0)
     , self_pointer_bytes_(0)
-    , child_data_bytes_(0)
+    , child_data_bits_(0)
     , child_pointer_bytes_(0)
     , self_data_weight_(0)
     , self_pointer_weight_(0)
     , child_data_weight_(0)
-    , child_pointer_weight_(0) { }
+    , child_pointer_weight_(0)
+    , self_lines_(0)
+    , self_pages_(0)
+    , distance_count_(0)
+    , distance_sum_(0)
+    , slots_set_(0)
+    , slots_null_(0)
+    , weight_error_(0) {
+  memset(distance_counts_, 0, sizeof(distance_counts_));
+}
+
+Stats &Stats::operator+=(const Stats &that) {
+  self_data_bits_ += that.self_data_bits_;
+  self_pointer_bytes_ += that.self_pointer_bytes_;
+  child_data_bits_ += that.child_data_bits_;
+  child_pointer_bytes_ += that.child_pointer_bytes_;
+  self_data_weight_ += that.self_data_weight_;
+  self_pointer_weight_ += that.self_pointer_weight_;
+  child_data_weight_ += that.child_data_weight_;
+  child_pointer_weight_ += that.child_pointer_weight_;
+  for (uint32_t i = 0; i < that.level_bytes_.size(); i++)
+    add_level_bytes(i, that.level_bytes_[i]);
+  add_sim_weights(that.sim_weights_.data(), that.sim_weights_.size());
+  self_lines_ += that.self_lines_;
+  self_pages_ += that.self_pages_;
+  for (uint32_t i = 0; i < kDistanceBuckets; i++)
+    distance_counts_[i] += that.distance_counts_[i];
+  distance_count_ += that.distance_count_;
+  distance_sum_ += that.distance_sum_;
+  slots_set_ += that.slots_set_;
+  slots_null_ += that.slots_null_;
+  self_reads_ += that.self_reads_;
+  child_reads_ += that.child_reads_;
+  weight_error_ += that.weight_error_;
+  return *this;
+}
+
+// More levels of folded recursion than this means the state is corrupt.
+static const uint32_t kMaxLevels = 1 << 16;
+
+static void write_reads(StateWriter &out, const ReadCost &reads) {
+  out.write(reads.hops);
+  out.write(reads.list_decodes);
+  out.write(reads.far_hops);
+  out.write(reads.bounds_checks);
+}
+
+static bool read_reads(StateReader &in, ReadCost *reads) {
+  return in.read(&reads->hops) && in.read(&reads->list_decodes) && in.read(&reads->far_hops)
+      && in.read(&reads->bounds_checks);
+}
+
+void Stats::write(StateWriter &out) const {
+  out.write(self_data_bits_);
+  out.write(self_pointer_bytes_);
+  out.write(child_data_bits_);
+  out.write(child_pointer_bytes_);
+  out.write(self_data_weight_);
+  out.write(self_pointer_weight_);
+  out.write(child_data_weight_);
+  out.write(child_pointer_weight_);
+  out.write(static_cast<uint32_t>(level_bytes_.size()));
+  for (uint32_t bytes : level_bytes_)
+    out.write(bytes);
+  out.write(self_lines_);
+  out.write(self_pages_);
+  for (uint32_t i = 0; i < kDistanceBuckets; i++)
+    out.write(distance_counts_[i]);
+  out.write(distance_count_);
+  out.write(distance_sum_);
+  out.write(slots_set_);
+  out.write(slots_null_);
+  write_reads(out, self_reads_);
+  write_reads(out, child_reads_);
+  out.write(weight_error_);
+}
+
+bool Stats::read(StateReader &in) {
+  uint32_t level_count = 0;
+  in.read(&self_data_bits_);
+  in.read(&self_pointer_bytes_);
+  in.read(&child_data_bits_);
+  in.read(&child_pointer_bytes_);
+  in.read(&self_data_weight_);
+  in.read(&self_pointer_weight_);
+  in.read(&child_data_weight_);
+  in.read(&child_pointer_weight_);
+  if (!in.read(&level_count) || level_count > kMaxLevels)
+    return false;
+  level_bytes_.assign(level_count, 0);
+  for (uint32_t i = 0; i < level_count; i++)
+    in.read(&level_bytes_[i]);
+  in.read(&self_lines_);
+  in.read(&self_pages_);
+  for (uint32_t i = 0; i < kDistanceBuckets; i++)
+    in.read(&distance_counts_[i]);
+  in.read(&distance_count_);
+  in.read(&distance_sum_);
+  in.read(&slots_set_);
+  in.read(&slots_null_);
+  read_reads(in, &self_reads_);
+  read_reads(in, &child_reads_);
+  in.read(&weight_error_);
+  return in.ok();
+}
+
+void Stats::add_distance(int64_t bytes) {
+  uint64_t magnitude = std::llabs(bytes);
+  uint32_t bucket = 0;
+  while (magnitude > 0 && bucket < kDistanceBuckets - 1) {
+    magnitude >>= 1;
+    bucket += 1;
+  }
+  distance_counts_[bucket] += 1;
+  distance_count_ += 1;
+  distance_sum_ += bytes;
+}
+
+void Stats::add_slot(bool is_set) {
+  if (is_set) {
+    slots_set_ += 1;
+  } else {
+    slots_null_ += 1;
+  }
+}
+
+void Stats::add_level_bytes(uint32_t level, uint32_t bytes) {
+  if (level_bytes_.size() <= level)
+    level_bytes_.resize(level + 1, 0);
+  level_bytes_[level] += bytes;
+}
+
+void Stats::add_sim_weights(const double *weights, uint32_t count) {
+  if (sim_weights_.size() < count)
+    sim_weights_.resize(count, 0);
+  for (uint32_t i = 0; i < count; i++)
+    sim_weights_[i] += weights[i];
+}
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
 namespace capnprof {
 
+class StateReader;
+class StateWriter;
+
 static inline uint32_t word_align(uint32_t value) {
   return (value + 0x7) & ~0x7;
 }
@@ -12,14 +16,42 @@ static inline const uint8_t *word_align(const uint8_t *ptr) {
   return reinterpret_cast<const uint8_t*>(word_align(reinterpret_cast<uint64_t>(ptr)));
 }
 
+// The work a reader does to get at some part of a message, and an estimate
+// of what it costs relative to a single pointer hop.
+struct ReadCost {
+  uint32_t hops;
+  uint32_t list_decodes;
+  uint32_t far_hops;
+  uint32_t bounds_checks;
+
+  ReadCost() : hops(0), list_decodes(0), far_hops(0), bounds_checks(0) { }
+  ReadCost &operator+=(const ReadCost &that);
+  double score() const;
+
+  static constexpr double kHopCost = 1.0;
+  static constexpr double kListDecodeCost = 1.0;
+  // Looking up the segment and reading the landing pad.
+  static constexpr double kFarHopCost = 3.0;
+  static constexpr double kBoundsCheckCost = 0.25;
+};
+
 class Stats {
 public:
   Stats();
+  Stats &operator+=(const Stats &that);
+
+  // Saves and loads the counts, for incremental profiling.
+  void write(StateWriter &out) const;
+  bool read(StateReader &in);
 
-  uint32_t self_data_bytes() const { return self_data_bytes_; }
+  // Data is counted in bits so bool fields can be charged exactly; the byte
+  // counts are rounded up.
+  uint64_t self_data_bits() const { return self_data_bits_; }
+  uint64_t child_data_bits() const { return child_data_bits_; }
+  uint32_t self_data_bytes() const { return bits_to_bytes(self_data_bits_); }
   uint32_t self_pointer_bytes() const { return self_pointer_bytes_; }
   uint32_t self_bytes() const { return self_data_bytes() + self_pointer_bytes(); }
-  uint32_t child_data_bytes() const { return child_data_bytes_; }
+  uint32_t child_data_bytes() const { return bits_to_bytes(child_data_bits_); }
   uint32_t child_pointer_bytes() const { return child_pointer_bytes_; }
   uint32_t child_bytes() const { return child_data_bytes() + child_pointer_bytes(); }
   uint32_t accum_bytes() const { return self_bytes() + child_bytes(); }
@@ -35,19 +67,87 @@ public:
   double self_factor() const { return safediv(self_weight(), self_bytes()); }
   double accum_factor() const { return safediv(accum_weight(), accum_bytes()); }
 
+  // Self bytes broken down by how many levels of folded recursion they were
+  // found under. Only recorded when recursion folding is enabled.
+  const std::vector<uint32_t> &level_bytes() const { return level_bytes_; }
+
+  // The number of distinct cache lines and pages the self bytes were found
+  // on in each message, summed over the messages.
+  uint32_t self_lines() const { return self_lines_; }
+  uint32_t self_pages() const { return self_pages_; }
+
+  // Distances from the pointers that lead to this trace to what they point
+  // to, bucketed by the number of bits needed to represent them.
+  static const uint32_t kDistanceBuckets = 32;
+  const uint32_t *distance_counts() const { return distance_counts_; }
+  uint32_t distance_count() const { return distance_count_; }
+  double mean_distance() const { return safediv(distance_sum_, distance_count_); }
+
+  // What a full read of this trace and everything under it would do.
+  const ReadCost &self_reads() const { return self_reads_; }
+  const ReadCost &child_reads() const { return child_reads_; }
+  double self_read_cost() const { return self_reads_.score(); }
+  double accum_read_cost() const { return self_reads_.score() + child_reads_.score(); }
+
+  // How often the pointer slot of the field this trace is for was set or
+  // null, when slot stats are enabled.
+  uint32_t slots_set() const { return slots_set_; }
+  uint32_t slots_null() const { return slots_null_; }
+  uint32_t null_slot_bytes() const { return slots_null_ * 8; }
+  double slot_occupancy() const { return safediv(slots_set_, slots_set_ + slots_null_); }
+
+  // The most accumulated weight this trace may be missing because traces
+  // with its path were evicted before it was created, see TracePool::trim.
+  double weight_error() const { return weight_error_; }
+
+  // The accumulated weight under each of the simulated codecs, when there
+  // are any.
+  double sim_weight(uint32_t index) const {
+    return index < sim_weights_.size() ? sim_weights_[index] : 0;
+  }
+
+  static const uint32_t kLineSize = 64;
+  static const uint32_t kPageSize = 4096;
+
   static double safediv(double a, double b) { return (b == 0) ? 0 : (a / b); }
 
 private:
+  friend class TraceContext;
   friend class TracePath;
-  uint32_t self_data_bytes_;
+  friend class TracePool;
+  void add_level_bytes(uint32_t level, uint32_t bytes);
+  void add_distance(int64_t bytes);
+  void add_slot(bool is_set);
+  void add_sim_weights(const double *weights, uint32_t count);
+  static uint32_t bits_to_bytes(uint64_t bits) { return static_cast<uint32_t>((bits + 7) / 8); }
+
+  uint64_t self_data_bits_;
   uint32_t self_pointer_bytes_;
-  uint32_t child_data_bytes_;
+  uint64_t child_data_bits_;
   uint32_t child_pointer_bytes_;
 
   double self_data_weight_;
   double self_pointer_weight_;
   double child_data_weight_;
   double child_pointer_weight_;
+
+  std::vector<uint32_t> level_bytes_;
+  std::vector<double> sim_weights_;
+
+  uint32_t self_lines_;
+  uint32_t self_pages_;
+
+  uint32_t distance_counts_[kDistanceBuckets];
+  uint32_t distance_count_;
+  double distance_sum_;
+
+  uint32_t slots_set_;
+  uint32_t slots_null_;
+
+  ReadCost self_reads_;
+  ReadCost child_reads_;
+
+  double weight_error_;
 };
 
 } // namespace capnprof
@@ -2,6 +2,8 @@
 
 #include "prof.hh"
 
+#include <fnmatch.h>
+
 #include <iostream>
 #include <algorithm>
 #include <sstream>
@@ -10,18 +12,60 @@ using namespace capnprof;
 using namespace kj;
 using namespace capnp;
 
+static const char kOtherName[] = "(other)";
+
 TraceContext::TraceContext(uint32_t max_depth, TracePool &pool, InputMap *input_map)
     : max_depth_(max_depth)
     , pool_(pool)
-    , input_map_(input_map) { }
+    , input_map_(input_map)
+    , refine_depth_(max_depth)
+    , hot_traces_(NULL)
+    , fold_recursion_(false)
+    , sketch_blobs_(false)
+    , gather_columns_(false)
+    , scope_(NULL)
+    , rollup_(NULL) { }
+
+void TraceContext::set_refinement(uint32_t refine_depth, TracePool *hot_traces) {
+  refine_depth_ = refine_depth;
+  hot_traces_ = hot_traces;
+}
+
+bool TraceContext::is_hot(const TracePath &path) {
+  return hot_traces_ != NULL && hot_traces_->find(path) != NULL;
+}
+
+void TraceContext::touch(Trace &trace, const void *start, uint32_t size) {
+  if (size == 0)
+    return;
+  Footprint &footprint = footprints_[&trace];
+  uintptr_t first_byte = reinterpret_cast<uintptr_t>(start);
+  uintptr_t last_byte = first_byte + size - 1;
+  for (uintptr_t line = first_byte / Stats::kLineSize; line <= last_byte / Stats::kLineSize;
+      line++) {
+    if (footprint.lines.insert(line).second)
+      trace.stats().self_lines_ += 1;
+  }
+  for (uintptr_t page = first_byte / Stats::kPageSize; page <= last_byte / Stats::kPageSize;
+      page++) {
+    if (footprint.pages.insert(page).second)
+      trace.stats().self_pages_ += 1;
+  }
+}
 
 TracePath::TracePath(TraceContext &context)
     : context_(context)
     , prev_(NULL)
+    , up_(NULL)
+    , length_(0)
+    , level_(0)
     , depth_(0)
     , name_hash_(0)
     , full_hash_(0)
-    , trace_cache_(NULL) { }
+    , trace_cache_(NULL)
+    , type_entry_(NULL)
+    , field_entry_(NULL)
+    , scope_depth_(0) { }
 
 TraceLink::TraceLink(StructSchema::Field field)
     : type_(Type::STRUCT_FIELD) {
@@ -53,7 +97,7 @@ std::string TraceLink::repr() const {
   }
 }
 
-uint32_t TraceLink::hash() {
+uint32_t TraceLink::hash() const {
   return std::hash<std::string>()(repr());
 }
 
@@ -77,16 +121,56 @@ bool TraceLink::operator!=(const TraceLink &that) const {
 TracePath::TracePath(TracePath &prev, TraceLink link)
     : context_(prev.context())
     , prev_(&prev)
+    , up_(&prev)
     , link_(link)
-    , depth_(std::min(prev.depth() + 1, context().max_depth()))
+    , length_(prev.length() + 1)
+    , level_(prev.level())
+    , depth_(0)
     , name_hash_(link.hash())
     , full_hash_(0)
-    , trace_cache_(NULL) {
+    , trace_cache_(NULL)
+    , type_entry_(NULL)
+    , field_entry_(NULL)
+    , scope_depth_(prev.scope_depth_) {
+  const std::vector<std::string> *scope = context().scope();
+  if (scope != NULL && in_scope() && scope_depth_ < static_cast<int32_t>(scope->size())
+      && link.type() == TraceLink::Type::STRUCT_FIELD) {
+    const char *name = link.as_struct_field()->getProto().getName().cStr();
+    if (fnmatch((*scope)[scope_depth_].c_str(), name, 0) == 0) {
+      scope_depth_ += 1;
+    } else {
+      scope_depth_ = -1;
+    }
+  }
+  if (context().rollup() != NULL && link.type() == TraceLink::Type::STRUCT_FIELD)
+    field_entry_ = &context().rollup()->field(*link.as_struct_field());
+  if (context().fold_recursion() && link.type() == TraceLink::Type::STRUCT_FIELD) {
+    for (const TracePath *current = &prev; current != NULL; current = current->up()) {
+      if (current->link() == link) {
+        // Take on the identity of the earlier occurrence.
+        up_ = current->up();
+        length_ = current->length();
+        level_ += 1;
+        break;
+      }
+    }
+  }
+  depth_ = std::min(length_, context().max_depth());
+  full_hash_ = suffix_hash(depth_);
+  if (depth_ < length_ && context().is_hot(*this)) {
+    depth_ = std::min(length_, context().refine_depth());
+    full_hash_ = suffix_hash(depth_);
+  }
+}
+
+uint32_t TracePath::suffix_hash(uint32_t depth) const {
+  uint32_t result = 0;
   const TracePath *current = this;
-  for (uint32_t i = 0; i < depth(); i++) {
-    full_hash_ = (full_hash_ ^ current->name_hash_);
-    current = current->prev();
+  for (uint32_t i = 0; i < depth; i++) {
+    result = (result ^ current->name_hash_);
+    current = current->up();
   }
+  return result;
 }
 
 bool TracePath::operator==(const TracePath &that) const {
@@ -97,8 +181,8 @@ bool TracePath::operator==(const TracePath &that) const {
   for (uint32_t i = 0; i < depth(); i++) {
     if (left->link() != right->link())
       return false;
-    left = left->prev();
-    right = right->prev();
+    left = left->up();
+    right = right->up();
   }
   return true;
 }
@@ -111,7 +195,7 @@ bool TracePath::operator==(const Trace &that) const {
   for (uint32_t i = 0; i < depth(); i++) {
     if (left->link() != right[i])
       return false;
-    left = left->prev();
+    left = left->up();
   }
   return true;
 }
@@ -140,35 +224,166 @@ void TracePath::for_each_parent(F func) {
     prev_->for_each_link(func);
 }
 
+template <typename F>
+void TracePath::for_each_rollup(F func) {
+  if (context().rollup() == NULL)
+    return;
+  // Recursive types show up more than once along a path.
+  for (TracePath *current = this; current != NULL; current = current->prev_) {
+    TypeRollup::Entry *entries[2] = {current->type_entry_, current->field_entry_};
+    for (TypeRollup::Entry *entry : entries) {
+      if (entry != NULL && !entry->is_seen) {
+        entry->is_seen = true;
+        func(entry->stats, current == this);
+      }
+    }
+  }
+  for (TracePath *current = this; current != NULL; current = current->prev_) {
+    if (current->type_entry_ != NULL)
+      current->type_entry_->is_seen = false;
+    if (current->field_entry_ != NULL)
+      current->field_entry_->is_seen = false;
+  }
+}
+
+void TracePath::set_struct(StructSchema schema) {
+  const std::vector<std::string> *scope = context().scope();
+  if (scope != NULL && prev_ == NULL) {
+    const char *name = schema.getShortDisplayName().cStr();
+    scope_depth_ = (fnmatch((*scope)[0].c_str(), name, 0) == 0) ? 1 : -1;
+  }
+  if (context().rollup() == NULL)
+    return;
+  type_entry_ = &context().rollup()->type(schema);
+  type_entry_->count += 1;
+}
+
 void TracePath::add_data(ArrayPtr<const byte> raw_data) {
   if (raw_data.size() == 0)
     return;
-  uint32_t raw_size = raw_data.size();
-  uint32_t padded_size = word_align(raw_size);
+  uint32_t padded_size = word_align(raw_data.size());
   double weight = context().input_map().weigh(raw_data.begin(), padded_size);
+  double sims[InputMap::kMaxSims];
+  uint32_t sim_count = context().input_map().weigh_sims(raw_data.begin(), 0, padded_size * 8,
+      sims);
+  add_data(raw_data.begin(), padded_size * 8, padded_size, weight, raw_data, sims, sim_count);
+}
+
+void TracePath::add_data_bits(ArrayPtr<const byte> section, uint32_t bit_offset,
+    uint32_t bit_count) {
+  if (bit_count == 0)
+    return;
+  const byte *start = section.begin() + (bit_offset / 8);
+  uint32_t size = ((bit_offset % 8) + bit_count + 7) / 8;
+  double weight = context().input_map().weigh_bits(section.begin(), bit_offset, bit_count);
+  double sims[InputMap::kMaxSims];
+  uint32_t sim_count = context().input_map().weigh_sims(section.begin(), bit_offset, bit_count,
+      sims);
+  // Only whole bytes make sense in a column.
+  ArrayPtr<const byte> column;
+  if (bit_offset % 8 == 0 && bit_count % 8 == 0)
+    column = ArrayPtr<const byte>(start, bit_count / 8);
+  add_data(start, bit_count, size, weight, column, sims, sim_count);
+}
+
+void TracePath::add_data(const byte *start, uint64_t bits, uint32_t size, double weight,
+    ArrayPtr<const byte> column, const double *sims, uint32_t sim_count) {
   Trace &trace = this->trace();
   trace.is_seen_ = true;
-  trace.stats().self_data_bytes_ += padded_size;
+  trace.stats().self_data_bits_ += bits;
   trace.stats().self_data_weight_ += weight;
+  trace.stats().add_sim_weights(sims, sim_count);
+  context().touch(trace, start, size);
+  if (context().gather_columns())
+    trace.column().append(reinterpret_cast<const char*>(column.begin()), column.size());
+  if (context().fold_recursion())
+    trace.stats().add_level_bytes(level(), size);
   for_each_parent([=](Trace &trace) {
-    trace.stats().child_data_bytes_ += padded_size;
+    trace.stats().child_data_bits_ += bits;
     trace.stats().child_data_weight_ += weight;
+    trace.stats().add_sim_weights(sims, sim_count);
   });
   trace.is_seen_ = false;
+  for_each_rollup([=](Stats &stats, bool is_self) {
+    if (is_self) {
+      stats.self_data_bits_ += bits;
+      stats.self_data_weight_ += weight;
+    } else {
+      stats.child_data_bits_ += bits;
+      stats.child_data_weight_ += weight;
+    }
+  });
 }
 
 void TracePath::add_pointers(ArrayPtr<const byte> pointers) {
   uint32_t size = pointers.size();
   double weight = context().input_map().weigh(pointers.begin(), size);
+  double sims[InputMap::kMaxSims];
+  uint32_t sim_count = context().input_map().weigh_sims(pointers.begin(), 0, size * 8, sims);
   Trace &trace = this->trace();
   trace.is_seen_ = true;
   trace.stats().self_pointer_bytes_ += size;
   trace.stats().self_pointer_weight_ += weight;
+  trace.stats().add_sim_weights(sims, sim_count);
+  context().touch(trace, pointers.begin(), size);
+  if (context().fold_recursion())
+    trace.stats().add_level_bytes(level(), size);
   for_each_parent([=](Trace &trace) {
     trace.stats().child_pointer_bytes_ += size;
     trace.stats().child_pointer_weight_ += weight;
+    trace.stats().add_sim_weights(sims, sim_count);
+  });
+  trace.is_seen_ = false;
+  for_each_rollup([=](Stats &stats, bool is_self) {
+    if (is_self) {
+      stats.self_pointer_bytes_ += size;
+      stats.self_pointer_weight_ += weight;
+    } else {
+      stats.child_pointer_bytes_ += size;
+      stats.child_pointer_weight_ += weight;
+    }
+  });
+}
+
+void TracePath::add_unwalked_bytes(uint64_t bytes) {
+  uint64_t bits = bytes * 8;
+  Trace &trace = this->trace();
+  trace.is_seen_ = true;
+  trace.stats().self_data_bits_ += bits;
+  for_each_parent([=](Trace &trace) {
+    trace.stats().child_data_bits_ += bits;
   });
   trace.is_seen_ = false;
+  for_each_rollup([=](Stats &stats, bool is_self) {
+    if (is_self) {
+      stats.self_data_bits_ += bits;
+    } else {
+      stats.child_data_bits_ += bits;
+    }
+  });
+}
+
+void TracePath::add_pointer_distance(int64_t bytes) {
+  trace().stats().add_distance(bytes);
+}
+
+void TracePath::add_reads(const ReadCost &cost) {
+  Trace &trace = this->trace();
+  trace.is_seen_ = true;
+  trace.stats().self_reads_ += cost;
+  for_each_parent([&](Trace &trace) {
+    trace.stats().child_reads_ += cost;
+  });
+  trace.is_seen_ = false;
+}
+
+void TracePath::add_slot(bool is_set) {
+  trace().stats().add_slot(is_set);
+}
+
+void TracePath::add_blob(ArrayPtr<const byte> data) {
+  if (context().sketch_blobs())
+    trace().blobs().add(data);
 }
 
 Trace::Trace(const TracePath &path, uint32_t serial)
@@ -176,14 +391,56 @@ Trace::Trace(const TracePath &path, uint32_t serial)
     , serial_(serial)
     , depth_(path.depth())
     , hash_(path.hash())
-    , is_seen_(false) {
+    , is_seen_(false)
+    , column_compressed_size_(0) {
   const TracePath *current = &path;
   for (uint32_t i = 0; i < depth(); i++) {
     path_[i] = current->link();
-    current = current->prev();
+    current = current->up();
+  }
+}
+
+Trace::Trace(const Trace &that, uint32_t serial)
+    : path_(new TraceLink[that.depth()], that.depth())
+    , serial_(serial)
+    , depth_(that.depth())
+    , hash_(that.hash())
+    , is_seen_(false)
+    , column_compressed_size_(0) {
+  for (uint32_t i = 0; i < depth(); i++)
+    path_[i] = that.path_[i];
+}
+
+Trace::Trace(ArrayPtr<const TraceLink> path, uint32_t serial)
+    : path_(new TraceLink[path.size()], path.size())
+    , serial_(serial)
+    , depth_(path.size())
+    , hash_(0)
+    , is_seen_(false)
+    , column_compressed_size_(0) {
+  for (uint32_t i = 0; i < depth(); i++) {
+    path_[i] = path[i];
+    hash_ = (hash_ ^ path[i].hash());
   }
 }
 
+BlobSketch &Trace::blobs() {
+  if (!blobs_)
+    blobs_.reset(new BlobSketch());
+  return *blobs_;
+}
+
+void Trace::absorb(const Trace &that) {
+  stats() += that.stats();
+  if (that.blob_sketch() != NULL)
+    blobs().merge(*that.blob_sketch());
+  column_ += that.column_;
+}
+
+bool Trace::is_other() const {
+  return depth() > 0 && path_[0] == TraceLink(kOtherName);
+}
+
 std::ostream &capnprof::operator<<(std::ostream &out, const Trace &trace) {
   if (trace.depth() == 0) {
     out << TraceLink().repr();
@@ -204,6 +461,30 @@ void Trace::print(std::ostream &out) {
     const TraceLink &part = path()[depth() - i - 1];
     out << "    " << part.repr() << std::endl;
   }
+  const std::vector<uint32_t> &level_bytes = stats().level_bytes();
+  if (level_bytes.size() > 1) {
+    out << "    (recursion";
+    for (uint32_t i = 0; i < level_bytes.size(); i++)
+      out << " " << i << ":" << level_bytes[i];
+    out << ")" << std::endl;
+  }
+  if (stats().distance_count() > 0) {
+    // Bucket b holds the distances that need b bits, so below 2^b bytes.
+    out << "    (distances";
+    for (uint32_t i = 0; i < Stats::kDistanceBuckets; i++) {
+      if (stats().distance_counts()[i] > 0)
+        out << " <" << (1ull << i) << ":" << stats().distance_counts()[i];
+    }
+    out << ")" << std::endl;
+  }
+  if (stats().weight_error() > 0)
+    out << "    (weight error " << stats().weight_error() << ")" << std::endl;
+  ReadCost reads = stats().self_reads();
+  reads += stats().child_reads();
+  if (reads.score() > 0) {
+    out << "    (reads hops:" << reads.hops << " lists:" << reads.list_decodes
+        << " far:" << reads.far_hops << " checks:" << reads.bounds_checks << ")" << std::endl;
+  }
 }
 
 Trace::~Trace() {
@@ -242,23 +523,127 @@ uint32_t TraceKey::Hash::operator()(const TraceKey &key) const {
 }
 
 TracePool::TracePool()
-    : next_serial_(0) { }
+    : next_serial_(0)
+    , max_traces_(0)
+    , evicted_count_(0)
+    , eviction_error_(0)
+    , lookups_(0)
+    , hits_(0)
+    , created_(0)
+    , bytes_(0)
+    , peak_size_(0)
+    , peak_bytes_(0) { }
 
 TracePool::~TracePool() {
+  clear();
+}
+
+void TracePool::clear() {
   for (auto entry : traces_)
     delete entry.second;
   traces_.clear();
+  evicted_count_ = 0;
+  eviction_error_ = 0;
+  lookups_ = 0;
+  hits_ = 0;
+  created_ = 0;
+  bytes_ = 0;
+  peak_size_ = 0;
+  peak_bytes_ = 0;
 }
 
 Trace &TracePool::get_or_create(const TracePath &path) {
+  lookups_ += 1;
   auto iter = traces_.find(TraceKey(path));
-  if (iter != traces_.end())
+  if (iter != traces_.end()) {
+    hits_ += 1;
     return *(iter->second);
-  Trace *trace = new Trace(path, next_serial_++);
+  }
+  return insert(new Trace(path, next_serial_++));
+}
+
+Trace &TracePool::get_or_create(const Trace &like) {
+  lookups_ += 1;
+  auto iter = traces_.find(TraceKey(like));
+  if (iter != traces_.end()) {
+    hits_ += 1;
+    return *(iter->second);
+  }
+  return insert(new Trace(like, next_serial_++));
+}
+
+Trace &TracePool::insert(Trace *trace) {
+  // Whatever was evicted with this trace's path weighed at most as much.
+  trace->stats().weight_error_ = eviction_error_;
   traces_[TraceKey(*trace)] = trace;
+  created_ += 1;
+  bytes_ += footprint(*trace);
+  peak_size_ = std::max<uint64_t>(peak_size_, traces_.size());
+  peak_bytes_ = std::max(peak_bytes_, bytes_);
   return *trace;
 }
 
+void TracePool::erase(Trace *trace) {
+  traces_.erase(TraceKey(*trace));
+  bytes_ -= footprint(*trace);
+  delete trace;
+}
+
+uint64_t TracePool::footprint(const Trace &trace) {
+  // The trace, its path and a hash map node holding its key.
+  return sizeof(Trace) + trace.depth() * sizeof(TraceLink)
+      + sizeof(TraceKey) + sizeof(Trace*) + 2 * sizeof(void*);
+}
+
+Trace *TracePool::find(const Trace &like) {
+  auto iter = traces_.find(TraceKey(like));
+  return (iter == traces_.end()) ? NULL : iter->second;
+}
+
+Trace *TracePool::find(const TracePath &path) {
+  auto iter = traces_.find(TraceKey(path));
+  return (iter == traces_.end()) ? NULL : iter->second;
+}
+
+void TracePool::merge(const TracePool &that) {
+  for (auto entry : that.traces_)
+    get_or_create(*entry.second).absorb(*entry.second);
+  evicted_count_ += that.evicted_count_;
+  eviction_error_ = std::max(eviction_error_, that.eviction_error_);
+  trim();
+}
+
+void TracePool::trim() {
+  if (max_traces_ == 0 || traces_.size() <= max_traces_)
+    return;
+  // Trim a little below the cap so we don't have to do this again right away.
+  uint32_t target = max_traces_ - (max_traces_ / 8);
+  std::vector<Trace*> candidates;
+  for (auto entry : traces_) {
+    if (entry.second->depth() > 0 && !entry.second->is_other())
+      candidates.push_back(entry.second);
+  }
+  auto upper_bound = [](const Trace *trace) {
+    return trace->stats().accum_weight() + trace->stats().weight_error();
+  };
+  std::sort(candidates.begin(), candidates.end(), [&](const Trace *a, const Trace *b) {
+    return upper_bound(a) < upper_bound(b);
+  });
+  for (Trace *trace : candidates) {
+    if (traces_.size() <= target)
+      break;
+    // The (other) trace has the same path as the evicted one except the last
+    // link.
+    kj::Array<TraceLink> other_path = kj::heapArray<TraceLink>(trace->path().asConst());
+    other_path[0] = TraceLink(kOtherName);
+    Trace &other = get_or_create(Trace(other_path.asConst(), 0));
+    other.absorb(*trace);
+    eviction_error_ = std::max(eviction_error_, upper_bound(trace));
+    evicted_count_ += 1;
+    erase(trace);
+  }
+}
+
 template <typename F>
 void TracePool::flush(F func, std::vector<Trace*> *traces_out) {
   for (auto entry : traces_)
@@ -300,6 +685,18 @@ void TracePool::flush(Trace::Order order, bool reverse, std::vector<Trace*> *tra
     return flush(Trace::by_stat(&Stats::self_factor), reverse, traces_out);
   case Trace::Order::ACCUM_FACTOR:
     return flush(Trace::by_stat(&Stats::accum_factor), reverse, traces_out);
+  case Trace::Order::SELF_LINES:
+    return flush(Trace::by_stat(&Stats::self_lines), reverse, traces_out);
+  case Trace::Order::SELF_PAGES:
+    return flush(Trace::by_stat(&Stats::self_pages), reverse, traces_out);
+  case Trace::Order::MEAN_DISTANCE:
+    return flush(Trace::by_stat(&Stats::mean_distance), reverse, traces_out);
+  case Trace::Order::NULL_SLOT_BYTES:
+    return flush(Trace::by_stat(&Stats::null_slot_bytes), reverse, traces_out);
+  case Trace::Order::SELF_READ_COST:
+    return flush(Trace::by_stat(&Stats::self_read_cost), reverse, traces_out);
+  case Trace::Order::ACCUM_READ_COST:
+    return flush(Trace::by_stat(&Stats::accum_read_cost), reverse, traces_out);
   default:
     break;
   }
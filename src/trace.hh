@@ -1,18 +1,23 @@
 #pragma once
 
+#include "blobs.hh"
+#include "rollup.hh"
 #include "stats.hh"
 
 #include <capnp/message.h>
 #include <capnp/dynamic.h>
 
 #include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace capnprof {
 
 class Trace;
+class TracePath;
 class TracePool;
 class InputMap;
 
@@ -23,10 +28,58 @@ public:
   TracePool &pool() { return pool_; }
   InputMap &input_map() { return *input_map_; }
 
+  // Paths whose max depth suffix is one of the traces in the given pool are
+  // traced to the refine depth instead of the max depth.
+  void set_refinement(uint32_t refine_depth, TracePool *hot_traces);
+  uint32_t refine_depth() { return refine_depth_; }
+  bool is_hot(const TracePath &path);
+
+  // When a struct field recurs along a path, fold the path back onto the
+  // earlier occurrence instead of extending it.
+  void set_fold_recursion(bool value) { fold_recursion_ = value; }
+  bool fold_recursion() { return fold_recursion_; }
+
+  // Keep a sketch of the blobs added to each trace.
+  void set_sketch_blobs(bool value) { sketch_blobs_ = value; }
+  bool sketch_blobs() { return sketch_blobs_; }
+
+  // Gather a copy of the data bytes added to each trace.
+  void set_gather_columns(bool value) { gather_columns_ = value; }
+  bool gather_columns() { return gather_columns_; }
+
+  // Only descend into the fields along the given path from the root, see
+  // Profiler::set_scope.
+  void set_scope(const std::vector<std::string> *scope) { scope_ = scope; }
+  const std::vector<std::string> *scope() { return scope_; }
+
+  // Roll up the bytes added to traces by struct type and field.
+  void set_rollup(TypeRollup *value) { rollup_ = value; }
+  TypeRollup *rollup() { return rollup_; }
+
+  // Records that self bytes of the trace were found at the given place and
+  // counts the cache lines and pages it hasn't been found on yet in this
+  // message.
+  void touch(Trace &trace, const void *start, uint32_t size);
+  // Forgets the lines and pages touched, once a message is done.
+  void clear_footprint() { footprints_.clear(); }
+
 private:
+  struct Footprint {
+    std::unordered_set<uintptr_t> lines;
+    std::unordered_set<uintptr_t> pages;
+  };
+
   uint32_t max_depth_;
   TracePool &pool_;
   InputMap *input_map_;
+  uint32_t refine_depth_;
+  TracePool *hot_traces_;
+  bool fold_recursion_;
+  bool sketch_blobs_;
+  bool gather_columns_;
+  const std::vector<std::string> *scope_;
+  TypeRollup *rollup_;
+  std::unordered_map<const Trace*, Footprint> footprints_;
 };
 
 class TraceLinkBehavior {
@@ -46,10 +99,11 @@ public:
   TraceLink(Type type) : type_(type) { }
   TraceLink(capnp::StructSchema::Field field);
   TraceLink(const char *value);
-  uint32_t hash();
+  uint32_t hash() const;
   bool operator==(const TraceLink &that) const;
   bool operator!=(const TraceLink &that) const;
   std::string repr() const;
+  Type type() const { return type_; }
 
   capnp::StructSchema::Field *as_struct_field() { return reinterpret_cast<capnp::StructSchema::Field*>(as_struct_field_); }
   const capnp::StructSchema::Field *as_struct_field() const { return reinterpret_cast<const capnp::StructSchema::Field*>(as_struct_field_); }
@@ -76,14 +130,52 @@ public:
   uint32_t hash() const { return full_hash_; }
 
   const TracePath *prev() const { return prev_; }
+  // The path this one extends as far as trace identity is concerned. This is
+  // the same as prev() except when recursion has been folded.
+  const TracePath *up() const { return up_; }
   const TraceLink &link() const { return link_; }
   uint32_t depth() const { return depth_; }
+  // The number of links from the root to here, regardless of max depth.
+  uint32_t length() const { return length_; }
+  // The number of times recursion has been folded along this path.
+  uint32_t level() const { return level_; }
   TraceContext &context() const { return context_; }
   Trace &trace();
 
   void add_data(kj::ArrayPtr<const kj::byte> data);
   void add_pointers(kj::ArrayPtr<const kj::byte> pointers);
 
+  // Adds the given range of bits within a struct's data section, for when
+  // the section is split between its fields.
+  void add_data_bits(kj::ArrayPtr<const kj::byte> section, uint32_t bit_offset,
+      uint32_t bit_count);
+
+  // Adds bytes that were counted but not walked, such as subtrees outside the
+  // scope. They add to the data bytes but not the weight or the footprint.
+  void add_unwalked_bytes(uint64_t bytes);
+
+  // Records the distance in bytes from the pointer that led here to its
+  // target.
+  void add_pointer_distance(int64_t bytes);
+
+  // Charges the work of reading something to this path.
+  void add_reads(const ReadCost &cost);
+
+  // Records whether the pointer slot of the field this path ends in was set.
+  void add_slot(bool is_set);
+
+  // Adds a Text or Data blob to the blob sketch, if enabled. The bytes
+  // themselves must be added separately.
+  void add_blob(kj::ArrayPtr<const kj::byte> data);
+
+  // Records that this path holds a struct of the given type, for the type
+  // rollup and for matching the root against the scope.
+  void set_struct(capnp::StructSchema schema);
+
+  // Whether this path is on the way to the scope or within it. Always true
+  // when there is no scope.
+  bool in_scope() const { return scope_depth_ >= 0; }
+
   template <typename F>
   inline void for_each_parent(F func);
 
@@ -91,13 +183,30 @@ public:
   inline void for_each_link(F func);
 
 private:
+  uint32_t suffix_hash(uint32_t depth) const;
+  void add_data(const kj::byte *start, uint64_t bits, uint32_t size, double weight,
+      kj::ArrayPtr<const kj::byte> column, const double *sims, uint32_t sim_count);
+
+  // Calls the function on the rollup entries of this path and the ones it
+  // extends, each once, and whether they are this path's own.
+  template <typename F>
+  inline void for_each_rollup(F func);
+
   TraceContext &context_;
   TracePath *prev_;
+  const TracePath *up_;
   TraceLink link_;
+  uint32_t length_;
+  uint32_t level_;
   uint32_t depth_;
   uint32_t name_hash_;
   uint32_t full_hash_;
   Trace *trace_cache_;
+  TypeRollup::Entry *type_entry_;
+  TypeRollup::Entry *field_entry_;
+  // The number of components of the scope matched so far, or -1 if this path
+  // has left it.
+  int32_t scope_depth_;
 };
 
 class Trace {
@@ -114,9 +223,18 @@ public:
     ACCUM_WEIGHT,
     SELF_FACTOR,
     ACCUM_FACTOR,
+    SELF_LINES,
+    SELF_PAGES,
+    MEAN_DISTANCE,
+    NULL_SLOT_BYTES,
+    SELF_READ_COST,
+    ACCUM_READ_COST,
   };
 
   Trace(const TracePath &path, uint32_t serial);
+  // Creates a trace with the same path as the given one but empty stats.
+  Trace(const Trace &that, uint32_t serial);
+  Trace(kj::ArrayPtr<const TraceLink> path, uint32_t serial);
   ~Trace();
 
   bool operator==(const Trace &that) const;
@@ -129,6 +247,22 @@ public:
   const Stats &stats() const { return stats_; }
   void print(std::ostream &out);
 
+  // Is this the trace that collects the evicted traces under a parent path?
+  bool is_other() const;
+
+  // The blob sketch, which is created on first use.
+  BlobSketch &blobs();
+  const BlobSketch *blob_sketch() const { return blobs_.get(); }
+
+  // The data bytes added to this trace, if they're being gathered, and their
+  // size when compressed on their own once that has been computed.
+  std::string &column() { return column_; }
+  uint64_t column_compressed_size() const { return column_compressed_size_; }
+  void set_column_compressed_size(uint64_t value) { column_compressed_size_ = value; }
+
+  // Adds the stats, sketches and columns of the given trace to this one.
+  void absorb(const Trace &that);
+
   static bool by_serial(const Trace *a, const Trace *b);
 
   template <typename R>
@@ -143,6 +277,9 @@ private:
   uint32_t hash_;
   bool is_seen_;
   Stats stats_;
+  std::unique_ptr<BlobSketch> blobs_;
+  std::string column_;
+  uint64_t column_compressed_size_;
 };
 
 std::ostream &operator<<(std::ostream &out, const Trace &trace);
@@ -170,8 +307,42 @@ public:
   TracePool();
   ~TracePool();
   Trace &get_or_create(const TracePath &path);
+  Trace &get_or_create(const Trace &like);
+  // Returns the trace in this pool with the same path as the given one, or
+  // NULL if there is none.
+  Trace *find(const Trace &like);
+  Trace *find(const TracePath &path);
   uint32_t size() { return traces_.size(); }
 
+  // Adds the stats of every trace in the given pool to the trace with the
+  // same path in this one, then trims this pool.
+  void merge(const TracePool &that);
+
+  // Deletes all the traces in this pool and resets its counters.
+  void clear();
+
+  // Caps the number of traces in the pool, 0 meaning no cap. This is the
+  // space-saving scheme: when the pool is trimmed the traces with the lowest
+  // upper bound, accumulated weight plus weight error, are folded into the
+  // (other) trace under their parent path until it is below the cap, and
+  // every trace created afterwards starts with the largest upper bound
+  // evicted so far as its weight error. Totals stay exact and the true
+  // accumulated weight of every trace is between its accumulated weight and
+  // that plus its weight error.
+  void set_max_traces(uint32_t value) { max_traces_ = value; }
+  void trim();
+  uint32_t evicted_count() { return evicted_count_; }
+  double eviction_error() { return eviction_error_; }
+
+  // How often paths were looked up and found, and the most traces and
+  // estimated bytes the pool has held at once. The estimate leaves out blob
+  // sketches and gathered columns.
+  uint64_t lookups() const { return lookups_; }
+  uint64_t hits() const { return hits_; }
+  uint64_t created() const { return created_; }
+  uint64_t peak_size() const { return peak_size_; }
+  uint64_t peak_bytes() const { return peak_bytes_; }
+
   void flush(Trace::Order order, bool reverse, std::vector<Trace*> *traces_out);
 
 private:
@@ -183,7 +354,20 @@ private:
   template <typename F>
   void flush(F func, bool reverse, std::vector<Trace*> *traces_out);
 
+  Trace &insert(Trace *trace);
+  void erase(Trace *trace);
+  static uint64_t footprint(const Trace &trace);
+
   uint32_t next_serial_;
+  uint32_t max_traces_;
+  uint32_t evicted_count_;
+  double eviction_error_;
+  uint64_t lookups_;
+  uint64_t hits_;
+  uint64_t created_;
+  uint64_t bytes_;
+  uint64_t peak_size_;
+  uint64_t peak_bytes_;
   std::unordered_map<TraceKey, Trace*, TraceKey::Hash> traces_;
 };
 
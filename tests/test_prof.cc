@@ -1,14 +1,33 @@
 // Copyright (c) 2018 Tundra. All right reserved.
 // Use of this code is governed by the terms defined in LICENSE.
 
+#include "archive.hh"
+#include "blobs.hh"
+#include "budget.hh"
+#include "cache.hh"
+#include "inflate.hh"
+#include "live.hh"
+#include "lz.hh"
+#include "pipeline.hh"
 #include "prof.hh"
+#include "static.hh"
+#include "test.capnp.cprof.h"
 
 #include <zipprof.h>
 
 #include "gtest/gtest.h"
 
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <sstream>
+#include <unordered_set>
+#include <capnp/schema.capnp.h>
 #include <capnp/serialize.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <zlib.h>
 
 using namespace capnprof;
 using namespace capnp;
@@ -95,6 +114,62 @@ static void profile_struct(Profiler &profiler, std::string struct_name,
   KJ_ASSERT(profiler.root().stats().accum_bytes() < bytes.size());
 }
 
+// Checks that two profilers have traces with the same paths and stats.
+static void expect_same_traces(Profiler &expected_profiler, Profiler &actual_profiler) {
+  std::vector<Trace*> expected;
+  expected_profiler.traces(Trace::Order::SERIAL, false, &expected);
+  std::vector<Trace*> actual;
+  actual_profiler.traces(Trace::Order::SERIAL, false, &actual);
+  std::map<std::string, const Trace*> actual_by_path;
+  for (const Trace *trace : actual) {
+    std::stringstream path;
+    path << *trace;
+    actual_by_path[path.str()] = trace;
+  }
+  EXPECT_EQ(expected.size(), actual.size());
+  for (const Trace *trace : expected) {
+    std::stringstream path;
+    path << *trace;
+    auto match = actual_by_path.find(path.str());
+    if (match == actual_by_path.end()) {
+      ADD_FAILURE() << "Missing trace " << path.str();
+      continue;
+    }
+    const Stats &want = trace->stats();
+    const Stats &got = match->second->stats();
+    EXPECT_EQ(want.self_data_bytes(), got.self_data_bytes()) << path.str();
+    EXPECT_EQ(want.self_pointer_bytes(), got.self_pointer_bytes()) << path.str();
+    EXPECT_EQ(want.accum_bytes(), got.accum_bytes()) << path.str();
+    EXPECT_DOUBLE_EQ(want.accum_weight(), got.accum_weight()) << path.str();
+    EXPECT_DOUBLE_EQ(want.self_read_cost(), got.self_read_cost()) << path.str();
+    EXPECT_DOUBLE_EQ(want.accum_read_cost(), got.accum_read_cost()) << path.str();
+  }
+}
+
+// A directory under /tmp that is removed, with everything in it, when it
+// goes out of scope.
+class TempDir {
+public:
+  explicit TempDir(const char *name) {
+    std::string pattern = std::string("/tmp/cprof-") + name + "-XXXXXX";
+    std::vector<char> buf(pattern.begin(), pattern.end());
+    buf.push_back('\0');
+    KJ_ASSERT(mkdtemp(buf.data()) != NULL);
+    path_ = buf.data();
+  }
+
+  ~TempDir() {
+    nftw(path_.c_str(), [](const char *path, const struct stat*, int, struct FTW*) {
+      return remove(path);
+    }, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  const std::string &path() const { return path_; }
+
+private:
+  std::string path_;
+};
+
 static void profile_struct_zipped(Profiler &profiler, std::string struct_name,
     const zipprof::Compressor &compr, std::function<void (DynamicStruct::Builder&)> thunk) {
   VectorOutputStream out;
@@ -132,6 +207,41 @@ TEST(prof, anything_works) {
   EXPECT_EQ(400, traces[2]->stats().self_bytes());
 }
 
+TEST(prof, max_traces) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_max_traces(3);
+
+  profile_struct(profiler, "Root", [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+    root.init("b", 200);
+    root.init("c", 400);
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+  EXPECT_EQ(3, traces.size());
+  EXPECT_EQ("Root.c", traces[0]->path()[0].repr());
+  EXPECT_EQ(1600, traces[0]->stats().self_bytes());
+  EXPECT_TRUE(traces[1]->is_other());
+  EXPECT_EQ(1200, traces[1]->stats().self_bytes());
+  EXPECT_EQ(2824, profiler.root().stats().accum_bytes());
+
+  // Root.b comes back carrying the largest weight evicted so far as its
+  // error, which covers what it lost to (other). Root.c goes instead.
+  profile_struct(profiler, "Root", [](DynamicStruct::Builder &root) {
+    root.init("b", 1000);
+  });
+  traces.clear();
+  profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+  ASSERT_EQ(3, traces.size());
+  EXPECT_EQ("Root.b", traces[0]->path()[0].repr());
+  EXPECT_EQ(4000, traces[0]->stats().self_bytes());
+  EXPECT_DOUBLE_EQ(800, traces[0]->stats().weight_error());
+  EXPECT_TRUE(traces[1]->is_other());
+  EXPECT_EQ(1200 + 1600, traces[1]->stats().self_bytes());
+}
+
 TEST(prof, singleton_primitive_list) {
   Profiler profiler;
   profiler.parse_schema("tests/res/test.capnp");
@@ -221,6 +331,111 @@ TEST(prof, point_list) {
   profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
   EXPECT_EQ(3, traces.size());
   EXPECT_EQ(48, traces[0]->stats().self_bytes());
+  // Everything but the segment table and root pointer, including the tag.
+  EXPECT_EQ(64, profiler.root().stats().accum_bytes());
+}
+
+TEST(prof, text_list) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+
+  profile_struct(profiler, "TextList", [](DynamicStruct::Builder &root) {
+    DynamicList::Builder texts = root.init("texts", 4).as<DynamicList>();
+    for (uint32_t i = 0; i < 4; i++)
+      texts.set(i, "abc");
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SERIAL, false, &traces);
+  ASSERT_EQ(3, traces.size());
+  EXPECT_EQ("TextList.texts", traces[1]->path()[0].repr());
+  EXPECT_EQ(32, traces[1]->stats().self_pointer_bytes());
+  EXPECT_EQ(32, traces[2]->stats().self_bytes());
+  EXPECT_EQ(72, profiler.root().stats().accum_bytes());
+}
+
+TEST(prof, scope) {
+  auto build = [](DynamicStruct::Builder &root) {
+    root.init("a", 10);
+    root.init("b", 20);
+    root.init("c", 30);
+  };
+  for (const char *scope : {"IntLists.b", "IntLists.[bx]", "Root.b"}) {
+    Profiler profiler;
+    profiler.parse_schema("tests/res/test.capnp");
+    profiler.set_scope(scope);
+    profile_struct(profiler, "IntLists", build);
+
+    std::vector<Trace*> traces;
+    profiler.traces(Trace::Order::SERIAL, false, &traces);
+    if (scope[0] == 'R') {
+      // Nothing under a root of another type is in scope.
+      ASSERT_EQ(2, traces.size());
+      EXPECT_EQ(40 + 80 + 120, profiler.out_of_scope_bytes());
+    } else {
+      ASSERT_EQ(3, traces.size());
+      EXPECT_EQ("IntLists.b", traces[2]->path()[0].repr());
+      EXPECT_EQ(80, traces[2]->stats().self_bytes());
+      EXPECT_EQ(40 + 120, profiler.out_of_scope_bytes());
+    }
+    // The skipped lists are still counted, just not walked.
+    EXPECT_EQ("(out of scope)", traces[1]->path()[0].repr());
+    EXPECT_EQ(profiler.out_of_scope_bytes(), traces[1]->stats().self_bytes());
+    EXPECT_EQ(0, traces[1]->stats().self_weight());
+    // Only the segment table and root pointer are left over.
+    EXPECT_EQ(profiler.message_bytes() - 16, profiler.root().stats().accum_bytes());
+  }
+}
+
+TEST(prof, footprint) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+
+  profile_struct(profiler, "Root", [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+    root.init("b", 200);
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+  EXPECT_EQ("Root.b", traces[0]->path()[0].repr());
+  // 800 bytes span 13 or 14 lines depending on alignment.
+  EXPECT_LE(13, traces[0]->stats().self_lines());
+  EXPECT_GE(14, traces[0]->stats().self_lines());
+  EXPECT_EQ(1, traces[0]->stats().distance_count());
+  // The a list sits between the b pointer and the b list.
+  EXPECT_EQ(8 + 400, traces[0]->stats().mean_distance());
+  std::stringstream printed;
+  traces[0]->print(printed);
+  EXPECT_NE(std::string::npos, printed.str().find("(distances <512:1)"));
+
+  // At depth 0 everything is charged to the root. Pair.values is laid out
+  // right after the root struct but walked last, so the root trace comes
+  // back to a line it was already found on.
+  Profiler flat;
+  flat.parse_schema("tests/res/test.capnp");
+  flat.set_trace_depth(0);
+  VectorOutputStream out;
+  build_message(flat, "Pair", out, [](DynamicStruct::Builder &root) {
+    root.init("values", 2);
+    root.init("left").as<DynamicStruct>().init("values", 64);
+  });
+  ArrayPtr<byte> bytes = out.getArray();
+  ArrayPtr<const word> words(reinterpret_cast<word*>(bytes.begin()),
+      bytes.size() / sizeof(word));
+  flat.profile("Pair", words);
+  // The segment table and the root pointer come before the traced bytes.
+  uintptr_t first_byte = reinterpret_cast<uintptr_t>(bytes.begin()) + 16;
+  uintptr_t last_byte = first_byte + 312 - 1;
+  uint32_t lines = last_byte / Stats::kLineSize - first_byte / Stats::kLineSize + 1;
+  uint32_t pages = last_byte / Stats::kPageSize - first_byte / Stats::kPageSize + 1;
+  EXPECT_EQ(312, flat.root().stats().self_bytes());
+  EXPECT_EQ(lines, flat.root().stats().self_lines());
+  EXPECT_EQ(pages, flat.root().stats().self_pages());
+  // Each message counts its own lines and pages.
+  flat.profile("Pair", words);
+  EXPECT_EQ(2 * lines, flat.root().stats().self_lines());
+  EXPECT_EQ(2 * pages, flat.root().stats().self_pages());
 }
 
 TEST(prof, linked_list) {
@@ -240,6 +455,366 @@ TEST(prof, linked_list) {
   EXPECT_EQ(240, traces[0]->stats().self_bytes());
 }
 
+TEST(prof, folded_linked_list) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_fold_recursion(true);
+
+  profile_struct(profiler, "Link", [](DynamicStruct::Builder &root) {
+    DynamicStruct::Builder current = root;
+    for (uint32_t i = 0; i < 16; i++)
+      current = current.init("next").as<DynamicStruct>();
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+  EXPECT_EQ(2, traces.size());
+  EXPECT_EQ(256, traces[0]->stats().self_bytes());
+  EXPECT_EQ(256, traces[1]->stats().child_bytes());
+  const std::vector<uint32_t> &levels = traces[0]->stats().level_bytes();
+  EXPECT_EQ(16, levels.size());
+  for (uint32_t level_bytes : levels)
+    EXPECT_EQ(16, level_bytes);
+}
+
+TEST(prof, type_rollup) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_trace_depth(2);
+  profiler.set_type_rollup(true);
+
+  profile_struct(profiler, "Link", [](DynamicStruct::Builder &root) {
+    DynamicStruct::Builder current = root;
+    for (uint32_t i = 0; i < 16; i++)
+      current = current.init("next").as<DynamicStruct>();
+  });
+
+  // The traces are cut off at depth 2 but the rollup sees every level, and
+  // counts each byte once however deeply the type recurses.
+  std::vector<const TypeRollup::Entry*> types = profiler.type_rollup()->types();
+  ASSERT_EQ(1, types.size());
+  EXPECT_EQ("Link", types[0]->name());
+  EXPECT_EQ(17, types[0]->count);
+  EXPECT_EQ(272, types[0]->stats.self_bytes());
+  EXPECT_EQ(272, types[0]->stats.accum_bytes());
+  EXPECT_DOUBLE_EQ(profiler.root().stats().accum_weight(), types[0]->stats.accum_weight());
+  std::vector<const TypeRollup::Entry*> fields = profiler.type_rollup()->fields();
+  ASSERT_EQ(1, fields.size());
+  EXPECT_EQ("Link.next", fields[0]->name());
+  EXPECT_EQ(256, fields[0]->stats.self_bytes());
+  EXPECT_EQ(256, fields[0]->stats.accum_bytes());
+}
+
+TEST(prof, refined_linked_list) {
+  for (double threshold : {0.5, 2.0}) {
+    Profiler profiler;
+    profiler.parse_schema("tests/res/test.capnp");
+    profiler.set_trace_depth(2);
+    auto build = [](DynamicStruct::Builder &root) {
+      DynamicStruct::Builder current = root;
+      for (uint32_t i = 0; i < 16; i++)
+        current = current.init("next").as<DynamicStruct>();
+    };
+    profile_struct(profiler, "Link", build);
+    profiler.refine(4, threshold);
+    profile_struct(profiler, "Link", build);
+    EXPECT_EQ(2, profiler.run_stats().messages());
+
+    std::vector<Trace*> traces;
+    profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+    if (threshold < 1) {
+      EXPECT_EQ(5, traces.size());
+      EXPECT_EQ(4, traces[0]->depth());
+      EXPECT_EQ(208, traces[0]->stats().self_bytes());
+    } else {
+      EXPECT_EQ(3, traces.size());
+      EXPECT_EQ(240, traces[0]->stats().self_bytes());
+    }
+  }
+}
+
+TEST(prof, refined_reordered_links) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_trace_depth(2);
+  auto build = [](DynamicStruct::Builder &root) {
+    DynamicStruct::Builder hot = root.init("left").as<DynamicStruct>();
+    hot = hot.init("left").as<DynamicStruct>().init("right").as<DynamicStruct>();
+    hot.init("values", 256);
+    root.init("right").as<DynamicStruct>().init("right").as<DynamicStruct>().init("left");
+  };
+  profile_struct(profiler, "Pair", build);
+  profiler.refine(3, 0.5);
+  profile_struct(profiler, "Pair", build);
+
+  // Pair.right Pair.left has the same links as the hot Pair.left Pair.right
+  // but isn't hot itself.
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SERIAL, false, &traces);
+  std::unordered_set<std::string> paths;
+  for (const Trace *trace : traces) {
+    std::stringstream path;
+    path << *trace;
+    paths.insert(path.str());
+  }
+  EXPECT_EQ(1, paths.count("Pair.left Pair.left Pair.right"));
+  EXPECT_EQ(1, paths.count("Pair.right Pair.left"));
+  EXPECT_EQ(0, paths.count("Pair.right Pair.right Pair.left"));
+}
+
+TEST(prof, canonical) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_canonical_what_if(true);
+
+  profile_struct(profiler, "Root", [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SERIAL, false, &traces);
+  std::vector<Trace*> canonical_traces;
+  profiler.canonical_traces(Trace::Order::SERIAL, false, &canonical_traces);
+  EXPECT_EQ(2, canonical_traces.size());
+  // The canonical root struct drops the two trailing null pointers.
+  EXPECT_EQ(0, traces[0]->depth());
+  EXPECT_EQ(24, traces[0]->stats().self_bytes());
+  EXPECT_EQ(0, canonical_traces[0]->depth());
+  EXPECT_EQ(8, canonical_traces[0]->stats().self_bytes());
+  EXPECT_EQ(400, canonical_traces[1]->stats().self_bytes());
+
+  // The original is zipped like the canonical encoding for the comparison,
+  // so the zeros of Root.a weigh next to nothing on both sides.
+  std::vector<Trace*> zipped_traces;
+  profiler.zipped_traces(Trace::Order::SERIAL, false, &zipped_traces);
+  ASSERT_EQ(2, zipped_traces.size());
+  EXPECT_EQ(400, zipped_traces[1]->stats().self_bytes());
+  EXPECT_EQ(400, traces[1]->stats().self_weight());
+  EXPECT_LT(zipped_traces[1]->stats().self_weight(), 40);
+  EXPECT_LT(canonical_traces[1]->stats().self_weight(), 40);
+}
+
+TEST(prof, columns) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_gather_columns(true);
+
+  profile_struct(profiler, "IntLists", [](DynamicStruct::Builder &root) {
+    root.init("a", 1024);
+    DynamicList::Builder ds = root.init("d", 1024).as<DynamicList>();
+    for (uint32_t i = 0; i < 1024; i++)
+      ds.set(i, std::rand());
+  });
+  profiler.compress_columns(9, 2);
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+  uint32_t columns = 0;
+  for (Trace *trace : traces) {
+    if (trace->column().empty())
+      continue;
+    columns += 1;
+    EXPECT_EQ(4096, trace->column().size());
+    if (trace->column().find_first_not_of('\0') == std::string::npos) {
+      EXPECT_GT(100, trace->column_compressed_size());
+    } else {
+      EXPECT_LT(2048, trace->column_compressed_size());
+    }
+  }
+  EXPECT_EQ(2, columns);
+}
+
+TEST(prof, run_stats) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+
+  for (uint32_t i = 0; i < 2; i++) {
+    profile_struct(profiler, "Root", [](DynamicStruct::Builder &root) {
+      root.init("a", 100);
+      root.init("b", 200);
+    });
+  }
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SERIAL, false, &traces);
+  RunStats &stats = profiler.run_stats();
+  EXPECT_EQ(2, stats.messages());
+  EXPECT_LT(0, stats.message_words());
+  EXPECT_EQ(traces.size(), stats.pool_counters().created);
+  EXPECT_EQ(traces.size(), stats.pool_counters().peak_traces);
+  EXPECT_LT(stats.pool_counters().created, stats.pool_counters().lookups);
+  EXPECT_EQ(stats.pool_counters().lookups - stats.pool_counters().created,
+      stats.pool_counters().hits);
+  EXPECT_LT(0, stats.seconds(RunStats::Stage::SCHEMA));
+  EXPECT_LT(0, stats.seconds(RunStats::Stage::TRAVERSE));
+
+  // Clearing starts the pool's counters over too.
+  profiler.clear();
+  RunStats &cleared = profiler.run_stats();
+  EXPECT_EQ(0, cleared.messages());
+  EXPECT_EQ(0, cleared.message_words());
+  EXPECT_EQ(0, cleared.pool_counters().lookups);
+  EXPECT_EQ(0, cleared.pool_counters().created);
+  EXPECT_EQ(0, cleared.pool_counters().peak_traces);
+}
+
+static bool ends_with(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size()
+      && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+TEST(prof, split_data) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_split_data(true);
+
+  profile_struct(profiler, "Packed", [](DynamicStruct::Builder &root) {
+    root.set("flag", true);
+    root.set("count", 7);
+    root.get("shape").as<DynamicStruct>().set("square", 3);
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SERIAL, false, &traces);
+  uint64_t field_bits = 0;
+  uint64_t padding_bits = 0;
+  for (Trace *trace : traces) {
+    std::string name = trace->path()[0].repr();
+    uint64_t bits = trace->stats().self_data_bits();
+    if (ends_with(name, ".flag")) {
+      EXPECT_EQ(1, bits);
+    } else if (ends_with(name, ".count")) {
+      EXPECT_EQ(16, bits);
+    } else if (ends_with(name, ".square")) {
+      EXPECT_EQ(8, bits);
+    } else if (ends_with(name, ".shape")) {
+      // The union discriminant.
+      EXPECT_EQ(16, bits);
+    } else if (name == "(padding)") {
+      padding_bits = bits;
+      continue;
+    } else {
+      EXPECT_EQ(0, bits);
+    }
+    field_bits += bits;
+  }
+  EXPECT_EQ(41, field_bits);
+  Stats &root = profiler.root().stats();
+  EXPECT_EQ(0, root.self_data_bits());
+  EXPECT_EQ(root.child_data_bits(), field_bits + padding_bits);
+  EXPECT_EQ(0, root.child_data_bits() % 64);
+}
+
+TEST(prof, slots) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_slot_stats(true);
+
+  for (uint32_t i = 0; i < 4; i++) {
+    profile_struct(profiler, "Root", [=](DynamicStruct::Builder &root) {
+      root.init("a", 1);
+      if (i == 0)
+        root.init("b", 1);
+    });
+  }
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::NULL_SLOT_BYTES, false, &traces);
+  EXPECT_EQ("Root.c", traces[0]->path()[0].repr());
+  EXPECT_EQ(0, traces[0]->stats().slots_set());
+  EXPECT_EQ(4, traces[0]->stats().slots_null());
+  EXPECT_EQ(32, traces[0]->stats().null_slot_bytes());
+  EXPECT_EQ("Root.b", traces[1]->path()[0].repr());
+  EXPECT_EQ(1, traces[1]->stats().slots_set());
+  EXPECT_EQ(3, traces[1]->stats().slots_null());
+  EXPECT_DOUBLE_EQ(0.25, traces[1]->stats().slot_occupancy());
+}
+
+TEST(prof, read_cost) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+
+  profile_struct(profiler, "Root", [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+    root.init("b", 200);
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::ACCUM_READ_COST, false, &traces);
+  EXPECT_EQ(0, traces[0]->depth());
+  EXPECT_EQ("Root.b", traces[1]->path()[0].repr());
+  const ReadCost &a = traces[2]->stats().self_reads();
+  EXPECT_EQ("Root.a", traces[2]->path()[0].repr());
+  EXPECT_EQ(1, a.hops);
+  EXPECT_EQ(1, a.list_decodes);
+  EXPECT_EQ(0, a.far_hops);
+  EXPECT_EQ(102, a.bounds_checks);
+  const ReadCost &root = traces[0]->stats().child_reads();
+  EXPECT_EQ(2, root.hops);
+  EXPECT_EQ(304, root.bounds_checks);
+  EXPECT_DOUBLE_EQ(1 + 0.25 + 2 + 2 + 304 * 0.25, traces[0]->stats().accum_read_cost());
+}
+
+// Profiles the same message with the dynamic traversal and with the
+// profilers capnpc-cprof generated for tests/res/test.capnp.
+static void expect_generated_traces(std::string struct_name,
+    std::function<void (DynamicStruct::Builder&)> build) {
+  SCOPED_TRACE(struct_name);
+  Profiler dynamic;
+  dynamic.parse_schema("tests/res/test.capnp");
+  profile_struct(dynamic, struct_name, build);
+
+  Profiler generated;
+  generated.parse_schema("tests/res/test.capnp");
+  cprof_test_capnp::add_profilers(generated);
+  profile_struct(generated, struct_name, build);
+
+  expect_same_traces(dynamic, generated);
+}
+
+TEST(prof, static_profiler) {
+  expect_generated_traces("PointList", [](DynamicStruct::Builder &root) {
+    DynamicList::Builder points = root.init("points", 3).as<DynamicList>();
+    for (uint32_t i = 0; i < 3; i++) {
+      points[i].as<DynamicStruct>().set("x", i);
+      points[i].as<DynamicStruct>().set("y", i * 2);
+    }
+  });
+  expect_generated_traces("Root", [](DynamicStruct::Builder &root) {
+    root.init("a", 10);
+    root.init("c", 3);
+  });
+  expect_generated_traces("AllPrimitiveLists", [](DynamicStruct::Builder &root) {
+    root.init("bools", 9);
+    root.init("int16s", 3);
+    root.init("float64s", 2);
+    root.init("enums", 5);
+  });
+  expect_generated_traces("TextList", [](DynamicStruct::Builder &root) {
+    DynamicList::Builder texts = root.init("texts", 2).as<DynamicList>();
+    texts.set(0, "first");
+    texts.set(1, "second text");
+  });
+  expect_generated_traces("Link", [](DynamicStruct::Builder &root) {
+    DynamicStruct::Builder current = root;
+    for (uint32_t i = 0; i < 4; i++) {
+      current.set("value", i);
+      current = current.init("next").as<DynamicStruct>();
+    }
+  });
+  expect_generated_traces("Pair", [](DynamicStruct::Builder &root) {
+    root.init("values", 2);
+    DynamicStruct::Builder left = root.init("left").as<DynamicStruct>();
+    left.init("values", 4);
+    left.init("right").as<DynamicStruct>().init("values", 1);
+  });
+  // Structs with unions are left to the dynamic traversal.
+  expect_generated_traces("Packed", [](DynamicStruct::Builder &root) {
+    root.set("count", 3);
+    root.get("shape").as<DynamicStruct>().set("square", 2);
+  });
+}
+
 TEST(prof, zipped) {
   Profiler profiler;
   profiler.parse_schema("tests/res/test.capnp");
@@ -266,3 +841,561 @@ TEST(prof, zipped) {
   profiler.dump(Trace::Order::ACCUM_WEIGHT);
 
 }
+
+static void build_envelope(DynamicStruct::Builder &root, StructSchema payload_schema,
+    const char *kind) {
+  root.set("kind", kind);
+  DynamicStruct::Builder payload = root.get("payload").as<AnyPointer>()
+      .initAs<DynamicStruct>(payload_schema);
+  payload.init("points", 3);
+}
+
+TEST(prof, any_pointer_mapping) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.add_type_mapping({"Envelope", "payload", "kind", "points", "PointList"});
+  StructSchema point_list = profiler.parsed_schema().getNested("PointList").asStruct();
+
+  profile_struct(profiler, "Envelope", [&](DynamicStruct::Builder &root) {
+    build_envelope(root, point_list, "points");
+  });
+  profile_struct(profiler, "Envelope", [&](DynamicStruct::Builder &root) {
+    build_envelope(root, point_list, "other");
+  });
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+  EXPECT_EQ("[]", traces[0]->path()[0].repr());
+  EXPECT_EQ("Envelope.payload", traces[0]->path()[2].repr());
+  EXPECT_EQ(48, traces[0]->stats().self_bytes());
+}
+
+TEST(prof, live) {
+  Profiler schemas;
+  schemas.parse_schema("tests/res/test.capnp");
+  LiveProfiler live(schemas.parsed_schema().getNested("Root").asStruct());
+  live.set_sample_rate(2).set_shard_count(2);
+  uint32_t root_c_bytes = 0;
+  uint64_t messages = 0;
+  live.set_snapshot_callback([&](Profiler &snapshot) {
+    std::vector<Trace*> traces;
+    snapshot.traces(Trace::Order::SELF_BYTES, false, &traces);
+    root_c_bytes = traces[0]->stats().self_bytes();
+    messages = snapshot.run_stats().messages();
+  });
+
+  VectorOutputStream out;
+  build_message(schemas, "Root", out, [](DynamicStruct::Builder &root) {
+    root.init("c", 400);
+  });
+  ArrayPtr<byte> bytes = out.getArray();
+  ArrayPtr<const word> words(reinterpret_cast<word*>(bytes.begin()),
+      bytes.size() / sizeof(word));
+  for (uint32_t i = 0; i < 8; i++)
+    live.sample(words);
+  EXPECT_EQ(4, live.sampled());
+  EXPECT_EQ(0, live.dropped());
+
+  live.snapshot();
+  EXPECT_EQ(4 * 1600, root_c_bytes);
+  EXPECT_EQ(4, messages);
+  // The shards start over after each snapshot, run stats included.
+  live.snapshot();
+  EXPECT_EQ(4 * 1600, root_c_bytes);
+  EXPECT_EQ(4, messages);
+  live.sample(words);
+  live.sample(words);
+  live.snapshot();
+  EXPECT_EQ(5, messages);
+}
+
+TEST(prof, live_instances) {
+  Profiler schemas;
+  schemas.parse_schema("tests/res/test.capnp");
+  StructSchema schema = schemas.parsed_schema().getNested("Root").asStruct();
+  LiveProfiler first(schema);
+  first.set_sample_rate(2).set_max_traces(3);
+  LiveProfiler second(schema);
+  second.set_sample_rate(3);
+  uint32_t trace_count = 0;
+  first.set_snapshot_callback([&](Profiler &snapshot) {
+    std::vector<Trace*> traces;
+    snapshot.traces(Trace::Order::SERIAL, false, &traces);
+    trace_count = traces.size();
+  });
+
+  VectorOutputStream out;
+  build_message(schemas, "Root", out, [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+    root.init("b", 200);
+    root.init("c", 400);
+  });
+  ArrayPtr<byte> bytes = out.getArray();
+  ArrayPtr<const word> words(reinterpret_cast<word*>(bytes.begin()),
+      bytes.size() / sizeof(word));
+  // Calls to one profiler don't count towards the other's rate.
+  for (uint32_t i = 0; i < 12; i++) {
+    first.sample(words);
+    second.sample(words);
+  }
+  EXPECT_EQ(6, first.sampled());
+  EXPECT_EQ(4, second.sampled());
+
+  first.snapshot();
+  EXPECT_EQ(3, trace_count);
+}
+
+TEST(prof, compiled_schema) {
+  Profiler parser;
+  parser.parse_schema("tests/res/test.capnp");
+  MallocMessageBuilder request_builder;
+  schema::CodeGeneratorRequest::Builder request =
+      request_builder.initRoot<schema::CodeGeneratorRequest>();
+  List<schema::Node>::Builder nodes = request.initNodes(2);
+  nodes.setWithCaveats(0, parser.parsed_schema().getProto());
+  nodes.setWithCaveats(1, parser.parsed_schema().getNested("Root").getProto());
+  kj::Array<word> request_words = messageToFlatArray(request_builder);
+
+  Profiler profiler;
+  profiler.load_schema(request_words);
+  VectorOutputStream out;
+  build_message(parser, "Root", out, [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+  });
+  ArrayPtr<byte> bytes = out.getArray();
+  profiler.profile("Root", ArrayPtr<const word>(reinterpret_cast<word*>(bytes.begin()),
+      bytes.size() / sizeof(word)));
+
+  std::vector<Trace*> traces;
+  profiler.traces(Trace::Order::SELF_BYTES, false, &traces);
+  EXPECT_EQ("Root.a", traces[0]->path()[0].repr());
+  EXPECT_EQ(400, traces[0]->stats().self_bytes());
+}
+
+static void append_u16(std::string *out, uint16_t value) {
+  out->push_back(value & 0xFF);
+  out->push_back(value >> 8);
+}
+
+static void append_u32(std::string *out, uint32_t value) {
+  append_u16(out, value & 0xFFFF);
+  append_u16(out, value >> 16);
+}
+
+// Builds a zip archive with the given entries stored uncompressed.
+static std::string build_stored_zip(std::vector<std::pair<std::string, std::string>> entries) {
+  std::string result;
+  std::string directory;
+  for (auto &entry : entries) {
+    uint32_t offset = result.size();
+    uint32_t crc = 0x12345678;
+    append_u32(&result, 0x04034b50);
+    append_u16(&result, 20);
+    append_u32(&result, 0);
+    append_u32(&result, 0);
+    append_u32(&result, crc);
+    append_u32(&result, entry.second.size());
+    append_u32(&result, entry.second.size());
+    append_u16(&result, entry.first.size());
+    append_u16(&result, 0);
+    result += entry.first + entry.second;
+
+    append_u32(&directory, 0x02014b50);
+    append_u16(&directory, 20);
+    append_u16(&directory, 20);
+    append_u32(&directory, 0);
+    append_u32(&directory, 0);
+    append_u32(&directory, crc);
+    append_u32(&directory, entry.second.size());
+    append_u32(&directory, entry.second.size());
+    append_u16(&directory, entry.first.size());
+    append_u32(&directory, 0);
+    append_u32(&directory, 0);
+    append_u32(&directory, 0);
+    append_u32(&directory, offset);
+    directory += entry.first;
+  }
+  uint32_t directory_offset = result.size();
+  result += directory;
+  append_u32(&result, 0x06054b50);
+  append_u32(&result, 0);
+  append_u16(&result, entries.size());
+  append_u16(&result, entries.size());
+  append_u32(&result, directory.size());
+  append_u32(&result, directory_offset);
+  append_u16(&result, 0);
+  return result;
+}
+
+TEST(prof, archive_index) {
+  std::string zip = build_stored_zip({{"a.bin", "hello"}, {"dir/b.bin", "hello world"}});
+  ArchiveIndex index(ArrayPtr<const uint8_t>(
+      reinterpret_cast<const uint8_t*>(zip.data()), zip.size()));
+  EXPECT_EQ(2, index.entries().size());
+  const ArchiveEntry *b = index.find("dir/b.bin");
+  ASSERT_TRUE(b != NULL);
+  EXPECT_EQ(11, b->size);
+  EXPECT_EQ(11, b->compressed_size);
+  EXPECT_EQ(0, b->method);
+  EXPECT_EQ(0x12345678, b->crc);
+  EXPECT_EQ(40, b->header_offset);
+  EXPECT_TRUE(index.find("c.bin") == NULL);
+
+  std::string truncated = zip.substr(0, zip.size() - 4);
+  ArchiveIndex broken(ArrayPtr<const uint8_t>(
+      reinterpret_cast<const uint8_t*>(truncated.data()), truncated.size()));
+  EXPECT_EQ(0, broken.entries().size());
+}
+
+TEST(prof, entry_rules) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profiler.set_heat_policy(HeatPolicy::MATCH);
+  // The first matching rule wins, and an empty type skips the entry.
+  profiler.add_entry_rule({"links/skip*", ""});
+  profiler.add_entry_rule({"links/*", "Link"});
+  profiler.add_entry_rule({"*.bin", "Root"});
+
+  VectorOutputStream root_out;
+  build_message(profiler, "Root", root_out, [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+  });
+  VectorOutputStream link_out;
+  build_message(profiler, "Link", link_out, [](DynamicStruct::Builder &root) {
+    root.init("next").as<DynamicStruct>().set("value", 7);
+  });
+  std::string root_message(root_out.getArray().asChars().begin(), root_out.getArray().size());
+  std::string link_message(link_out.getArray().asChars().begin(), link_out.getArray().size());
+  std::string zip = build_stored_zip({{"roots/a.bin", root_message},
+      {"links/b.bin", link_message}, {"links/skip.bin", link_message},
+      {"notes.txt", "not a message"}});
+  // Without a default type, entries no rule matches are skipped too.
+  profiler.profile_archive("", ArrayPtr<const uint8_t>(
+      reinterpret_cast<const uint8_t*>(zip.data()), zip.size()));
+
+  const std::vector<EntrySummary> &entries = profiler.entries();
+  ASSERT_EQ(2, entries.size());
+  EXPECT_EQ("roots/a.bin", entries[0].name);
+  EXPECT_EQ("Root", entries[0].type);
+  EXPECT_EQ(root_message.size(), entries[0].raw_bytes);
+  EXPECT_EQ("links/b.bin", entries[1].name);
+  EXPECT_EQ("Link", entries[1].type);
+  EXPECT_EQ(2, profiler.run_stats().entries());
+
+  char *dumped = NULL;
+  size_t dumped_size = 0;
+  FILE *out = open_memstream(&dumped, &dumped_size);
+  profiler.dump_entries(10, out);
+  fclose(out);
+  std::string report(dumped, dumped_size);
+  free(dumped);
+  // The Root entry holds the 400 byte list so it ranks first.
+  size_t root_line = report.find(" Root roots/a.bin\n");
+  size_t link_line = report.find(" Link links/b.bin\n");
+  EXPECT_NE(std::string::npos, root_line);
+  EXPECT_NE(std::string::npos, link_line);
+  EXPECT_LT(root_line, link_line);
+  EXPECT_EQ(std::string::npos, report.find("skip.bin"));
+  EXPECT_EQ(std::string::npos, report.find("notes.txt"));
+}
+
+TEST(prof, profile_cache) {
+  TempDir dir("cache");
+  ProfileCache cache(dir.path());
+  ArchiveEntry entry = {"a.bin", 0, 8, 0xCAFEF00D, 7, 11, 0};
+  std::string contents = "hello world";
+  std::vector<double> weights;
+  for (uint32_t i = 0; i < contents.size(); i++)
+    weights.push_back(i * 0.5);
+
+  CachedProfile cached;
+  EXPECT_FALSE(cache.load(entry, HeatPolicy::LITERAL, &cached));
+  cache.store(entry, HeatPolicy::LITERAL, ArrayPtr<const uint8_t>(
+      reinterpret_cast<const uint8_t*>(contents.data()), contents.size()), weights);
+  ASSERT_TRUE(cache.load(entry, HeatPolicy::LITERAL, &cached));
+  EXPECT_EQ(11, cached.size);
+  EXPECT_EQ(contents, std::string(reinterpret_cast<const char*>(cached.contents.begin()), 11));
+  EXPECT_EQ(weights, cached.weights);
+  // The temp file was renamed into place rather than left beside it.
+  size_t files = 0;
+  DIR *listing = opendir(dir.path().c_str());
+  ASSERT_NE(nullptr, listing);
+  while (struct dirent *item = readdir(listing))
+    files += item->d_name[0] != '.';
+  closedir(listing);
+  EXPECT_EQ(1, files);
+  ArrayHeatMap heat_map(cached.weights);
+  EXPECT_DOUBLE_EQ(0.5 + 1 + 1.5, heat_map.weight(1, 4));
+
+  // A different checksum is a different entry.
+  entry.crc += 1;
+  EXPECT_FALSE(cache.load(entry, HeatPolicy::LITERAL, &cached));
+  EXPECT_EQ(1, cache.hits());
+  EXPECT_EQ(2, cache.misses());
+}
+
+TEST(prof, state) {
+  TempDir dir("state");
+  std::string path = dir.path() + "/state";
+  auto build = [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+    root.init("b", 200);
+  };
+
+  Profiler before;
+  before.parse_schema("tests/res/test.capnp");
+  profile_struct(before, "Root", build);
+  ASSERT_TRUE(before.save_state(path));
+
+  // Loading the state and adding another message is the same as profiling
+  // both messages in one go.
+  VectorOutputStream out;
+  build_message(before, "Root", out, build);
+  ArrayPtr<const word> words(reinterpret_cast<word*>(out.getArray().begin()),
+      out.getArray().size() / sizeof(word));
+  Profiler after;
+  after.parse_schema("tests/res/test.capnp");
+  ASSERT_TRUE(after.load_state(path));
+  after.profile("Root", words);
+  before.profile("Root", words);
+  std::vector<Trace*> traces;
+  after.traces(Trace::Order::SERIAL, false, &traces);
+  EXPECT_EQ(3, traces.size());
+  expect_same_traces(before, after);
+
+  // A state traced to a different depth can't be mixed in.
+  Profiler deeper;
+  deeper.parse_schema("tests/res/test.capnp");
+  deeper.set_trace_depth(8);
+  EXPECT_FALSE(deeper.load_state(path));
+  EXPECT_EQ(0, deeper.root().stats().accum_bytes());
+}
+
+TEST(prof, pipeline) {
+  TempDir dir("pipeline");
+  Profiler sequential;
+  sequential.parse_schema("tests/res/test.capnp");
+  sequential.set_heat_policy(HeatPolicy::MATCH);
+  std::vector<std::string> paths;
+  for (uint32_t i = 0; i < 6; i++) {
+    std::vector<std::pair<std::string, std::string>> entries;
+    for (uint32_t j = 0; j <= i % 3; j++) {
+      VectorOutputStream out;
+      build_message(sequential, "Root", out, [&](DynamicStruct::Builder &root) {
+        root.init("a", 10 * (i + 1) + j);
+        root.init("b", 7 * j);
+      });
+      ArrayPtr<byte> bytes = out.getArray();
+      entries.emplace_back("m" + std::to_string(j) + ".bin",
+          std::string(bytes.asChars().begin(), bytes.size()));
+    }
+    paths.push_back(dir.path() + "/" + std::to_string(i) + ".zip");
+    std::ofstream(paths.back(), std::ios::binary) << build_stored_zip(entries);
+  }
+  // An archive given twice only has its entries profiled once, even though
+  // the second copy is prepared before the first is profiled.
+  paths.push_back(paths[0]);
+
+  for (std::string path : paths) {
+    std::string contents = ArchivePipeline::read_file(path);
+    sequential.profile_archive("Root", ArrayPtr<const uint8_t>(
+        reinterpret_cast<const uint8_t*>(contents.data()), contents.size()), path);
+  }
+  Profiler pipelined;
+  pipelined.parse_schema("tests/res/test.capnp");
+  pipelined.set_heat_policy(HeatPolicy::MATCH);
+  ArchivePipeline pipeline(pipelined);
+  pipeline.set_reader_count(3)
+      .set_inflater_count(3)
+      .set_readahead(1)
+      .set_entry_buffer(1);
+  pipeline.run("Root", paths);
+
+  EXPECT_EQ(sequential.run_stats().entries(), pipelined.run_stats().entries());
+  EXPECT_EQ(1, pipelined.run_stats().skipped_entries());
+  ASSERT_EQ(sequential.entries().size(), pipelined.entries().size());
+  for (uint32_t i = 0; i < sequential.entries().size(); i++) {
+    EXPECT_EQ(sequential.entries()[i].archive, pipelined.entries()[i].archive);
+    EXPECT_EQ(sequential.entries()[i].name, pipelined.entries()[i].name);
+    EXPECT_DOUBLE_EQ(sequential.entries()[i].weight, pipelined.entries()[i].weight);
+  }
+  expect_same_traces(sequential, pipelined);
+}
+
+// Compresses to a raw deflate stream, as stored in zip archives.
+static std::string deflate_raw(const std::string &data) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  std::string result(deflateBound(&stream, data.size()), 0);
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&result[0]);
+  stream.avail_out = result.size();
+  deflate(&stream, Z_FINISH);
+  result.resize(stream.total_out);
+  deflateEnd(&stream);
+  return result;
+}
+
+static double sum(const std::vector<double> &weights, uint32_t start, uint32_t end) {
+  double result = 0;
+  for (uint32_t i = start; i < end; i++)
+    result += weights[i];
+  return result;
+}
+
+TEST(prof, inflate_heat) {
+  std::string data;
+  for (uint32_t i = 0; i < 64; i++)
+    data += "tenant-0001;";
+  std::string compressed = deflate_raw(data);
+  ArrayPtr<const uint8_t> stream(reinterpret_cast<const uint8_t*>(compressed.data()),
+      compressed.size());
+
+  Inflater match(HeatPolicy::MATCH);
+  ASSERT_TRUE(match.inflate(stream));
+  EXPECT_EQ(data, std::string(match.contents().begin(), match.contents().end()));
+  EXPECT_GT(match.match_count(), 0);
+  EXPECT_NEAR(compressed.size(), sum(match.weights(), 0, data.size()), 1e-6);
+
+  // Crediting the source moves weight back to the first copy, which every
+  // match copies from.
+  Inflater source(HeatPolicy::MATCH_SOURCE);
+  ASSERT_TRUE(source.inflate(stream));
+  EXPECT_NEAR(compressed.size(), sum(source.weights(), 0, data.size()), 1e-6);
+  EXPECT_GT(sum(source.weights(), 0, 12), sum(match.weights(), 0, 12));
+
+  EXPECT_FALSE(match.inflate(stream.slice(0, stream.size() / 2)));
+}
+
+TEST(prof, lz_simulator) {
+  LzConfig config;
+  ASSERT_TRUE(LzConfig::parse("lz4=64K:4:raw", &config));
+  EXPECT_EQ("lz4", config.name);
+  EXPECT_EQ(65536, config.window);
+  EXPECT_EQ(4, config.min_match);
+  EXPECT_TRUE(config.literals == LzConfig::Literals::RAW);
+  EXPECT_FALSE(LzConfig::parse("=64K", &config));
+  EXPECT_FALSE(LzConfig::parse("x=64Q", &config));
+  EXPECT_FALSE(LzConfig::parse("x=64K:2", &config));
+  EXPECT_FALSE(LzConfig::parse("x=64K:4:huffman", &config));
+
+  // A literal, then a single match at distance 1 for the other 999 bytes.
+  std::vector<uint8_t> zeros(1000, 0);
+  LzSimulator simulator(config);
+  simulator.compress(arrayPtr(zeros.data(), zeros.size()));
+  EXPECT_EQ(1, simulator.literal_count());
+  EXPECT_EQ(1, simulator.match_count());
+  EXPECT_DOUBLE_EQ((9 + 1 + 1 + 19) / 8.0, simulator.total_bytes());
+
+  // Noise repeated 4K later only compresses with a window that reaches back.
+  std::vector<uint8_t> noise(8192);
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < 4096; i++) {
+    seed = seed * 1103515245 + 12345;
+    noise[i] = noise[i + 4096] = seed >> 16;
+  }
+  LzConfig small;
+  ASSERT_TRUE(LzConfig::parse("small=1K:4:raw", &small));
+  LzSimulator small_simulator(small);
+  small_simulator.compress(arrayPtr(noise.data(), noise.size()));
+  LzConfig large;
+  ASSERT_TRUE(LzConfig::parse("large=8K:4:raw", &large));
+  LzSimulator large_simulator(large);
+  large_simulator.compress(arrayPtr(noise.data(), noise.size()));
+  EXPECT_LT(large_simulator.total_bytes(), small_simulator.total_bytes() * 0.6);
+}
+
+TEST(prof, lz_sims) {
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  LzConfig configs[2];
+  ASSERT_TRUE(LzConfig::parse("lz4=64K:4:raw", &configs[0]));
+  ASSERT_TRUE(LzConfig::parse("zstd=1M:3:entropy", &configs[1]));
+  profiler.add_lz_config(configs[0]);
+  profiler.add_lz_config(configs[1]);
+
+  VectorOutputStream out;
+  build_message(profiler, "Link", out, [](DynamicStruct::Builder &root) {
+    DynamicStruct::Builder current = root;
+    for (uint32_t i = 0; i < 16; i++) {
+      current.set("value", i % 3);
+      current = current.init("next").as<DynamicStruct>();
+    }
+  });
+  ArrayPtr<byte> bytes = out.getArray();
+  profiler.profile("Link", ArrayPtr<const word>(reinterpret_cast<word*>(bytes.begin()),
+      bytes.size() / sizeof(word)));
+
+  // Everything but the segment table and the root pointer is traced.
+  const Stats &root = profiler.root().stats();
+  EXPECT_DOUBLE_EQ(root.accum_bytes(), root.accum_weight());
+  for (uint32_t i = 0; i < 2; i++) {
+    LzSimulator simulator(configs[i]);
+    simulator.compress(bytes);
+    ArrayHeatMap heat_map(simulator.weights());
+    EXPECT_NEAR(heat_map.weight(16, bytes.size()), root.sim_weight(i), 1e-9);
+  }
+  EXPECT_LT(root.sim_weight(0), root.accum_bytes());
+}
+
+TEST(prof, budget) {
+  std::stringstream rules(
+      "# Limits for Root\n"
+      "(root)   bytes  1K\n"
+      "Root.a   bytes  +10%\n"
+      "Root.*   factor 2\n");
+  Budget budget;
+  std::string error;
+  ASSERT_TRUE(budget.parse(rules, &error));
+  ASSERT_EQ(3, budget.rules().size());
+  EXPECT_DOUBLE_EQ(1024, budget.rules()[0].limit);
+  EXPECT_TRUE(budget.rules()[1].is_relative);
+  EXPECT_DOUBLE_EQ(0.1, budget.rules()[1].limit);
+
+  Profiler baseline;
+  baseline.parse_schema("tests/res/test.capnp");
+  profile_struct(baseline, "Root", [](DynamicStruct::Builder &root) {
+    root.init("a", 100);
+  });
+  Profiler profiler;
+  profiler.parse_schema("tests/res/test.capnp");
+  profile_struct(profiler, "Root", [](DynamicStruct::Builder &root) {
+    root.init("a", 120);
+    root.init("b", 200);
+  });
+
+  // The root is over its absolute limit and Root.a grew by 20%. Root.b isn't
+  // in the baseline so only its absolute rule applies.
+  std::vector<BudgetViolation> violations = budget.check(profiler, &baseline);
+  ASSERT_EQ(2, violations.size());
+  EXPECT_EQ("(root)", violations[0].path);
+  EXPECT_EQ(2, violations[0].rule->line);
+  EXPECT_EQ("Root.a", violations[1].path);
+  EXPECT_DOUBLE_EQ(480, violations[1].value);
+  EXPECT_DOUBLE_EQ(400 * 1.1, violations[1].limit);
+
+  std::stringstream bad("Root.a bytes lots\n");
+  Budget invalid;
+  EXPECT_FALSE(invalid.parse(bad, &error));
+  EXPECT_EQ("Invalid budget on line 1: Root.a bytes lots", error);
+}
+
+TEST(prof, blob_sketch) {
+  BlobSketch sketch;
+  std::string tag = "tenant-0001";
+  for (uint32_t i = 0; i < 100; i++)
+    sketch.add(ArrayPtr<const byte>(reinterpret_cast<const byte*>(tag.data()), tag.size()));
+  for (uint32_t i = 0; i < 1000; i++) {
+    std::string unique = "url-" + std::to_string(i);
+    sketch.add(ArrayPtr<const byte>(reinterpret_cast<const byte*>(unique.data()), unique.size()));
+  }
+  EXPECT_EQ(1100, sketch.count());
+  EXPECT_NEAR(1001, sketch.distinct(), 1001 * 0.15);
+  std::vector<BlobSketch::Blob> top = sketch.top();
+  EXPECT_EQ("tenant-0001", top[0].sample);
+  EXPECT_EQ(100, top[0].count);
+  EXPECT_EQ(16, top[0].size);
+  EXPECT_NEAR(99 * 16, sketch.interning_savings(), 1000 * 8 * 0.15);
+}